@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <disk.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+static const struct {
+	const char *name;
+	enum block_backend backend;
+} backends[] = {
+	{ "seek",	BLOCK_BACKEND_SEEK },
+	{ "pread",	BLOCK_BACKEND_PREAD },
+	{ "mmap",	BLOCK_BACKEND_MMAP },
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *backend, const char *op, size_t blocks,
+				   size_t syscalls, double ns)
+{
+	printf("%-6s %-6s %8zu %9zu %8.2f %10.1f\n", backend, op, blocks,
+		   syscalls, (double)syscalls / blocks, ns / blocks);
+}
+
+/* Requests of the queued pass that are not in flight */
+static struct block_request **idle;
+static unsigned nidle;
+
+static void request_done(struct block_request *req)
+{
+	ASSERT(!req->result, "block_queue_complete");
+	idle[nidle++] = req;
+}
+
+/*
+ * Read every block of the disk once, one request per block, through @q. All
+ * the requests not in flight are submitted together.
+ */
+static void queue_read_all(struct block_queue *q, size_t count)
+{
+	struct block_request **batch = idle;
+	size_t i = 0;
+	unsigned n;
+
+	while (i < count) {
+		while (!nidle)
+			ASSERT(block_queue_complete(q, 1) >= 0, "block_queue_complete");
+		n = count - i < nidle ? count - i : nidle;
+		nidle -= n;
+		batch = idle + nidle;
+		for (unsigned j = 0; j < n; j++)
+			batch[j]->block = i++;
+		ASSERT(!block_queue_submit(q, batch, n), "block_queue_submit");
+	}
+	ASSERT(block_queue_complete(q, block_queue_pending(q)) >= 0,
+	       "block_queue_complete");
+}
+
+/*
+ * Time whole-disk sequential reads, then the same reads with up to [depth]
+ * asynchronous requests in flight, then in-place rewrites of the same data,
+ * for each block backend. The image content is left unchanged.
+ */
+int main(int argc, char *argv[])
+{
+	char buf[BLOCK_SIZE];
+	char *diskname;
+	int passes = 10;
+	unsigned depth = BLOCK_QUEUE_DEPTH;
+	size_t count, blocks, syscalls;
+	struct block_request *reqs;
+	struct block_queue *q;
+	char *bufs;
+	double start;
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage> [passes] [depth]\n", argv[0]);
+		exit(1);
+	}
+	diskname = argv[1];
+	if (argc > 2)
+		passes = atoi(argv[2]);
+	if (argc > 3 && atoi(argv[3]) > 0)
+		depth = atoi(argv[3]);
+
+	reqs = calloc(depth, sizeof(*reqs));
+	bufs = malloc((size_t)depth * BLOCK_SIZE);
+	idle = malloc(depth * sizeof(*idle));
+	ASSERT(reqs && bufs && idle, "malloc");
+	for (unsigned i = 0; i < depth; i++) {
+		reqs[i].count = 1;
+		reqs[i].buf = bufs + (size_t)i * BLOCK_SIZE;
+		reqs[i].done = request_done;
+		idle[nidle++] = &reqs[i];
+	}
+
+	printf("%-6s %-6s %8s %9s %8s %10s\n", "backend", "op", "blocks",
+		   "syscalls", "per_blk", "ns_per_blk");
+
+	for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+		ASSERT(!block_disk_open_backend(diskname, backends[b].backend),
+			   "block_disk_open_backend");
+		count = block_disk_count();
+		blocks = count * passes;
+
+		syscalls = block_disk_syscalls();
+		start = now_ns();
+		for (int p = 0; p < passes; p++)
+			for (size_t i = 0; i < count; i++)
+				ASSERT(!block_read(i, buf), "block_read");
+		report(backends[b].name, "read", blocks,
+			   block_disk_syscalls() - syscalls, now_ns() - start);
+
+		q = block_queue_open(depth);
+		ASSERT(q, "block_queue_open");
+		syscalls = block_disk_syscalls();
+		start = now_ns();
+		for (int p = 0; p < passes; p++)
+			queue_read_all(q, count);
+		report(backends[b].name, "aread", blocks,
+			   block_disk_syscalls() - syscalls, now_ns() - start);
+		ASSERT(!block_queue_close(q), "block_queue_close");
+
+		syscalls = block_disk_syscalls();
+		start = now_ns();
+		for (int p = 0; p < passes; p++) {
+			for (size_t i = 0; i < count; i++) {
+				ASSERT(!block_read(i, buf), "block_read");
+				ASSERT(!block_write(i, buf), "block_write");
+			}
+		}
+		report(backends[b].name, "rewrite", blocks * 2,
+			   block_disk_syscalls() - syscalls, now_ns() - start);
+
+		ASSERT(!block_disk_close(), "block_disk_close");
+	}
+
+	free(idle);
+	free(reqs);
+	free(bufs);
+
+	return 0;
+}
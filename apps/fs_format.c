@@ -0,0 +1,179 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE 4096
+#define SIGNATURE "ECS150FS"
+#define VERSION_FAT32 1
+#define VERSION_EXTENTS 2
+#define FAT_EOC 0xFFFFFFFF
+#define FAT32_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define SUPERBLOCK_CLEAN 0xC1
+#define JOURNAL_MAGIC "ECSJRNL"
+#define JOURNAL_MIN_BLOCKS 32
+#define JOURNAL_DEFAULT_MIN 32
+#define JOURNAL_DEFAULT_MAX 1024
+
+#define format_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Superblock of a 32-bit FAT disk, as read by fs_mount() */
+struct __attribute__((packed)) superblock {
+	char signature[8];
+	/* 16-bit geometry of fs_make.x disks, left zero */
+	uint16_t total_blk_count16;
+	uint16_t rdir_blk16;
+	uint16_t data_blk16;
+	uint16_t data_blk_count16;
+	uint8_t fat_blk_count16;
+	uint8_t version;
+	uint32_t total_blk_count;
+	uint32_t rdir_blk;
+	uint32_t data_blk;
+	uint32_t data_blk_count;
+	uint32_t fat_blk_count;
+	uint32_t journal_blk;
+	uint32_t journal_blk_count;
+	/* Free data blocks, trusted by fs_mount() if marked clean */
+	uint32_t free_blk_count;
+	uint8_t clean;
+	uint8_t padding[BLOCK_SIZE - 51];
+};
+
+/* First block of the journal region: no transaction logged yet */
+struct __attribute__((packed)) journal_header {
+	char magic[8];
+	uint64_t sequence;
+	uint8_t padding[BLOCK_SIZE - 16];
+};
+
+static int write_block(int fd, size_t block, const void *buf)
+{
+	if (pwrite(fd, buf, BLOCK_SIZE, (off_t)block * BLOCK_SIZE) != BLOCK_SIZE) {
+		perror("pwrite");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Create a virtual disk holding an empty file system with a 32-bit FAT. Same
+ * usage as fs_make.x, but the disk and its files can grow past the 8192 data
+ * blocks and 64 KiB offsets of the 16-bit format. Blocks that hold nothing but
+ * zeroes are not written, so large disks are created as sparse files.
+ *
+ * With -e, files are described by a list of extents kept in one block per file
+ * instead of FAT chains, and the FAT only records which blocks are in use.
+ *
+ * A journal region is reserved between the root directory and the data blocks,
+ * through which libfs logs its metadata updates. Its size is picked from the
+ * data block count unless given with -j, and -j 0 leaves it out.
+ */
+int main(int argc, char *argv[])
+{
+	struct superblock sb;
+	struct journal_header jh;
+	uint32_t fat[FAT32_ENTRIES_PER_BLOCK];
+	char *diskname, *end;
+	unsigned long long data_count, fat_count, journal_count = 0, total;
+	int fd, opt, journal_set = 0, version = VERSION_FAT32;
+
+	while ((opt = getopt(argc, argv, "ej:")) != -1) {
+		switch (opt) {
+		case 'e':
+			version = VERSION_EXTENTS;
+			break;
+		case 'j':
+			journal_count = strtoull(optarg, &end, 10);
+			if (*end != '\0' || (journal_count &&
+					      journal_count < JOURNAL_MIN_BLOCKS)) {
+				format_error("journal needs 0 or at least %d blocks",
+					     JOURNAL_MIN_BLOCKS);
+				exit(1);
+			}
+			journal_set = 1;
+			break;
+		default:
+			exit(1);
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc < 3) {
+		format_error("Usage: [-e] [-j <journal block count>] <diskname> <data block count>");
+		exit(1);
+	}
+	diskname = argv[1];
+
+	/* block_disk_count() reports the disk size as an int */
+	data_count = strtoull(argv[2], &end, 10);
+	fat_count = (data_count + FAT32_ENTRIES_PER_BLOCK - 1) /
+		    FAT32_ENTRIES_PER_BLOCK;
+	if (!journal_set) {
+		journal_count = data_count / 64;
+		if (journal_count < JOURNAL_DEFAULT_MIN)
+			journal_count = JOURNAL_DEFAULT_MIN;
+		if (journal_count > JOURNAL_DEFAULT_MAX)
+			journal_count = JOURNAL_DEFAULT_MAX;
+	}
+	total = 1 + fat_count + 1 + journal_count + data_count;
+	if (*end != '\0' || data_count < 1 || total > INT_MAX) {
+		format_error("data block count invalid, disk must stay under %d blocks",
+			     INT_MAX);
+		exit(1);
+	}
+
+	memset(&sb, 0, sizeof(sb));
+	memcpy(sb.signature, SIGNATURE, sizeof(sb.signature));
+	sb.version = version;
+	sb.total_blk_count = total;
+	sb.fat_blk_count = fat_count;
+	sb.rdir_blk = 1 + fat_count;
+	sb.journal_blk = journal_count ? sb.rdir_blk + 1 : 0;
+	sb.journal_blk_count = journal_count;
+	sb.data_blk = sb.rdir_blk + 1 + journal_count;
+	sb.data_blk_count = data_count;
+	sb.free_blk_count = data_count - 1;
+	sb.clean = SUPERBLOCK_CLEAN;
+
+	/* Replay starts at transaction 1, which is not in the log yet */
+	memset(&jh, 0, sizeof(jh));
+	memcpy(jh.magic, JOURNAL_MAGIC, sizeof(jh.magic));
+	jh.sequence = 1;
+
+	/* Data block 0 is never handed out */
+	memset(fat, 0, sizeof(fat));
+	fat[0] = FAT_EOC;
+
+	fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	if (ftruncate(fd, (off_t)total * BLOCK_SIZE)) {
+		perror("ftruncate");
+		close(fd);
+		exit(1);
+	}
+
+	if (write_block(fd, 0, &sb) || write_block(fd, 1, fat) ||
+	    (journal_count && write_block(fd, sb.journal_blk, &jh))) {
+		close(fd);
+		exit(1);
+	}
+
+	close(fd);
+
+	printf("Created virtual disk '%s' with '%llu' data blocks\n", diskname,
+	       data_count);
+
+	return 0;
+}
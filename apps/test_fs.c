@@ -29,6 +29,20 @@ do {							\
 } while (0)
 
 
+/* Mount options taken from the environment, FS_BACKEND=mmap memory-maps the
+ * disk instead of going through the block cache */
+const struct fs_mount_opts *mount_opts(void)
+{
+	static struct fs_mount_opts opts = {
+		.backend = FS_BACKEND_MMAP,
+	};
+	const char *backend = getenv("FS_BACKEND");
+
+	if (backend && !strcmp(backend, "mmap"))
+		return &opts;
+	return NULL;
+}
+
 struct thread_arg {
 	int argc;
 	char **argv;
@@ -78,7 +92,8 @@ void thread_fs_script(void *arg)
 		command = command_args[0];
 
 		int data_fd;
-		int count, data_size;
+		ssize_t count;
+		int data_size;
 
 		char *read_buf;
 
@@ -87,7 +102,7 @@ void thread_fs_script(void *arg)
 			break;
 
 		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
+			if (fs_mount_opts(diskname, mount_opts()))
 				die("Cannot mount disk");
 			else {
 				printf("MOUNT successful.\n");
@@ -152,6 +167,29 @@ void thread_fs_script(void *arg)
 				printf("SEEK successful.\n");
 			}
 
+		} else if (strcmp(command, "FALLOCATE") == 0) {
+			if (fs_fallocate(fs_fd, atoi(command_args[1]))) {
+				fs_umount();
+				die("Cannot reserve blocks");
+			}
+
+			printf("FALLOCATE successful.\n");
+
+		} else if (strcmp(command, "SYNC") == 0) {
+			if (fs_sync()) {
+				fs_umount();
+				die("Cannot sync");
+			}
+
+			printf("SYNC successful.\n");
+
+		} else if (strcmp(command, "CRASH") == 0) {
+			/* Stop without unmounting, leaving the blocks still
+			   cached unwritten, as a crash would */
+			printf("CRASH.\n");
+			fflush(stdout);
+			_exit(0);
+
 		} else if (strcmp(command, "WRITE") == 0) {
 			data_source = command_args[1];
 			data_description = command_args[2];
@@ -190,7 +228,7 @@ void thread_fs_script(void *arg)
 				fs_umount();
 				die("write error");
 			}
-			printf("Wrote %d bytes to file.\n", count);
+			printf("Wrote %zd bytes to file.\n", count);
 
 		} else if (strcmp(command, "READ") == 0) {
 			int read_req_length = atoi(command_args[1]);
@@ -251,7 +289,7 @@ void thread_fs_script(void *arg)
 			// both data and read_buf were allocated with an extra zero byte
 			// +1 here to check for the canaries
 			if (memcmp(data, read_buf, data_size+1) == 0)
-				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
+				printf("Read %zd bytes from file. Compared %d correct.\n", count, data_size);
 			else
 				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
 
@@ -275,7 +313,7 @@ void thread_fs_stat(void *arg)
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename;
 	int fs_fd;
-	int stat;
+	ssize_t stat;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -283,7 +321,7 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_opts(diskname, mount_opts()))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -314,7 +352,7 @@ void thread_fs_stat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Size of file '%s' is %d bytes\n", filename, stat);
+	printf("Size of file '%s' is %zd bytes\n", filename, stat);
 }
 
 void thread_fs_cat(void *arg)
@@ -322,7 +360,8 @@ void thread_fs_cat(void *arg)
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename, *buf;
 	int fs_fd;
-	int stat, read;
+	ssize_t stat;
+	ssize_t read;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -330,7 +369,7 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_opts(diskname, mount_opts()))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -366,7 +405,7 @@ void thread_fs_cat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
+	printf("Read file '%s' (%zd/%zd bytes)\n", filename, read, stat);
 	printf("Content of the file:\n");
 	fwrite(buf, 1, stat, stdout);
 	fflush(stdout);
@@ -385,7 +424,7 @@ void thread_fs_rm(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_opts(diskname, mount_opts()))
 		die("Cannot mount diskname");
 
 	if (fs_delete(filename)) {
@@ -399,13 +438,38 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *path;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <path>");
+
+	diskname = t_arg->argv[0];
+	path = t_arg->argv[1];
+
+	if (fs_mount_opts(diskname, mount_opts()))
+		die("Cannot mount diskname");
+
+	if (fs_mkdir(path)) {
+		fs_umount();
+		die("Cannot create directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created directory '%s'\n", path);
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename, *buf;
 	int fd, fs_fd;
 	struct stat st;
-	int written;
+	ssize_t written;
 
 	if (t_arg->argc < 2)
 		die("Usage: <diskname> <host filename>");
@@ -431,7 +495,7 @@ void thread_fs_add(void *arg)
 	 * - mount, create a new file, copy content of host file into this new
 	 *   file, close the new file, and umount
 	 */
-	if (fs_mount(diskname))
+	if (fs_mount_opts(diskname, mount_opts()))
 		die("Cannot mount diskname");
 
 	if (fs_create(filename)) {
@@ -445,6 +509,10 @@ void thread_fs_add(void *arg)
 		die("Cannot open file");
 	}
 
+	/* Reserve the whole file up front, it is written as much as possible
+	 * anyway if the disk is too small */
+	fs_fallocate(fs_fd, st.st_size);
+
 	written = fs_write(fs_fd, buf, st.st_size);
 
 	if (fs_close(fs_fd)) {
@@ -455,27 +523,96 @@ void thread_fs_add(void *arg)
 	if (fs_umount())
 		die("Cannot unmount diskname");
 
-	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
+	printf("Wrote file '%s' (%zd/%zu bytes)\n", filename, written,
 		   st.st_size);
 
 	munmap(buf, st.st_size);
 	close(fd);
 }
 
+void thread_fs_copy(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *src_disk, *dst_disk, *filename;
+	fs_t *src, *dst;
+	int src_fd, dst_fd;
+	char buf[1000];
+	ssize_t read, total = 0;
+
+	if (t_arg->argc < 3)
+		die("Usage: <src diskname> <dst diskname> <filename>");
+
+	src_disk = t_arg->argv[0];
+	dst_disk = t_arg->argv[1];
+	filename = t_arg->argv[2];
+
+	/* Both disks are mounted at once, each as its own instance */
+	src = fs_mount_opts_h(src_disk, mount_opts());
+	if (!src)
+		die("Cannot mount source diskname");
+
+	dst = fs_mount_opts_h(dst_disk, mount_opts());
+	if (!dst) {
+		fs_umount_h(src);
+		die("Cannot mount destination diskname");
+	}
+
+	src_fd = fs_open_h(src, filename);
+	if (src_fd < 0 || fs_create_h(dst, filename)) {
+		fs_umount_h(dst);
+		fs_umount_h(src);
+		die("Cannot open or create file");
+	}
+
+	dst_fd = fs_open_h(dst, filename);
+	if (dst_fd < 0) {
+		fs_umount_h(dst);
+		fs_umount_h(src);
+		die("Cannot open file");
+	}
+
+	/* Interleave the operations on both instances, in chunks that do not
+	 * line up with blocks */
+	while ((read = fs_read_h(src, src_fd, buf, sizeof(buf))) > 0) {
+		if (fs_write_h(dst, dst_fd, buf, read) != read) {
+			fs_umount_h(dst);
+			fs_umount_h(src);
+			die("Cannot write file");
+		}
+		total += read;
+	}
+
+	if (fs_close_h(dst, dst_fd) || fs_close_h(src, src_fd)) {
+		fs_umount_h(dst);
+		fs_umount_h(src);
+		die("Cannot close file");
+	}
+
+	if (fs_umount_h(dst))
+		die("Cannot unmount destination diskname");
+	if (fs_umount_h(src))
+		die("Cannot unmount source diskname");
+
+	printf("Copied file '%s' (%zd bytes)\n", filename, total);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname;
 
 	if (t_arg->argc < 1)
-		die("Usage: <diskname>");
+		die("Usage: <diskname> [directory]");
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_opts(diskname, mount_opts()))
 		die("Cannot mount diskname");
 
-	fs_ls();
+	if (t_arg->argc > 1)
+		fs_lsdir(t_arg->argv[1]);
+	else
+		fs_ls();
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
@@ -491,7 +628,7 @@ void thread_fs_info(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_opts(diskname, mount_opts()))
 		die("Cannot mount diskname");
 
 	fs_info();
@@ -515,7 +652,9 @@ static struct {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "copy",	thread_fs_copy },
 	{ "rm",		thread_fs_rm },
+	{ "mkdir",	thread_fs_mkdir },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
 	{ "script",	thread_fs_script }
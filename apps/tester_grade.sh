@@ -265,7 +265,7 @@ create_delete_ls() {
     local line_array=()
     line_array+=("$(select_line "${STDOUT}" "2")") # Assuming "file: test-file-1" is in the second line
     local corr_array=()
-    corr_array+=("file: simple_reader.c, size: 0, data_blk: 65535")
+    corr_array+=("file: simple_reader.c, size: 1030, data_blk: 1")
     local create_score
     compare_lines line_array[@] corr_array[@] create_score
     log "Create Score: ${create_score}"
@@ -361,6 +361,340 @@ END_SCRIPT
     log "Score: ${score}"
 }
 
+# block reads and writes again, with test_fs.x mounting the disk memory-mapped
+mmap_backend() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    FS_BACKEND=mmap read_block
+    FS_BACKEND=mmap overwrite_block
+}
+
+# fill a disk made with fs_format.x -e, then read it back after remounting
+extents_full() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_tool ./fs_format.x -e test.fs 10
+    python3 -c "for i in range(4096): print('a', end='')" > test-file-1
+    cp test-file-1 test-file-2
+    cp test-file-1 test-file-3
+    cp test-file-1 test-file-4
+    cp test-file-1 test-file-5
+
+    # Each file takes an extent block and a data block, which leaves the fifth
+    # one a single free block: no room for its data
+    for i in 1 2 3 4 5; do
+        run_tool ./test_fs.x add test.fs test-file-${i}
+    done
+
+    local line_array=()
+    local corr_array=()
+
+    run_test ./test_fs.x info test.fs
+    line_array+=("$(select_line "${STDOUT}" "9")")
+    corr_array+=("fat_free_ratio=1/10")
+
+    run_test ./test_fs.x ls test.fs
+    line_array+=("$(select_line "${STDOUT}" "5")")
+    corr_array+=("file: test-file-4, size: 4096, data_blk: 8")
+    line_array+=("$(select_line "${STDOUT}" "6")")
+    corr_array+=("file: test-file-5, size: 0, data_blk: 4294967295")
+
+    run_test ./test_fs.x cat test.fs test-file-4
+    line_array+=("$(select_line "${STDOUT}" "1")")
+    corr_array+=("Read file 'test-file-4' (4096/4096 bytes)")
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    corr_array+=("$(cat test-file-4)")
+
+    rm -f test.fs test-file-1 test-file-2 test-file-3 test-file-4 test-file-5
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# blocks reserved by fs_fallocate(), then filled by a later write
+fallocate_run() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_tool ./fs_format.x test.fs 100
+    python3 -c "for i in range(16384): print('f', end='')" > test-file-1
+
+    # The second file goes past the run reserved for the first one
+    cat <<END_SCRIPT > fallocate_run.script
+MOUNT
+CREATE	test-file-1
+OPEN	test-file-1
+FALLOCATE	16384
+CLOSE
+CREATE	test-file-2
+OPEN	test-file-2
+WRITE	DATA	hello
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_tool ./test_fs.x script test.fs fallocate_run.script
+
+    local line_array=()
+    local corr_array=()
+
+    run_test ./test_fs.x info test.fs
+    line_array+=("$(select_line "${STDOUT}" "9")")
+    corr_array+=("fat_free_ratio=94/100")
+
+    run_test ./test_fs.x ls test.fs
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    corr_array+=("file: test-file-1, size: 0, data_blk: 1")
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    corr_array+=("file: test-file-2, size: 5, data_blk: 5")
+
+    run_test ./test_fs.x stat test.fs test-file-1
+    line_array+=("$(select_line "${STDOUT}" "1")")
+    corr_array+=("Empty file")
+
+    # The write lands in the reserved run without taking any other block
+    cat <<END_SCRIPT > fallocate_run.script
+MOUNT
+OPEN	test-file-1
+WRITE	FILE	test-file-1
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_tool ./test_fs.x script test.fs fallocate_run.script
+
+    run_test ./test_fs.x info test.fs
+    line_array+=("$(select_line "${STDOUT}" "9")")
+    corr_array+=("fat_free_ratio=94/100")
+
+    run_test ./test_fs.x ls test.fs
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    corr_array+=("file: test-file-1, size: 16384, data_blk: 1")
+
+    run_test ./test_fs.x cat test.fs test-file-1
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    corr_array+=("$(cat test-file-1)")
+
+    rm -f test.fs test-file-1 fallocate_run.script
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# nested directories, each step on a fresh mount
+directories() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_tool ./fs_format.x test.fs 100
+    mkdir -p dir1/sub
+    python3 -c "for i in range(5000): print('c', end='')" > dir1/sub/test-file-1
+
+    # Each directory gets a header block and a bucket with its first entry
+    run_tool ./test_fs.x mkdir test.fs dir1
+    run_tool ./test_fs.x mkdir test.fs dir1/sub
+    run_tool ./test_fs.x add test.fs dir1/sub/test-file-1
+
+    local line_array=()
+    local corr_array=()
+
+    run_test ./test_fs.x ls test.fs
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    corr_array+=("dir: dir1, size: 8192, data_blk: 1")
+
+    run_test ./test_fs.x ls test.fs dir1
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    corr_array+=("dir: sub, size: 8192, data_blk: 3")
+
+    run_test ./test_fs.x ls test.fs /dir1/sub
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    corr_array+=("file: test-file-1, size: 5000, data_blk: 5")
+
+    run_test ./test_fs.x cat test.fs dir1/sub/test-file-1
+    line_array+=("$(select_line "${STDOUT}" "1")")
+    corr_array+=("Read file 'dir1/sub/test-file-1' (5000/5000 bytes)")
+
+    # Non-empty directories stay
+    run_test ./test_fs.x rm test.fs dir1
+    line_array+=("$(select_line "${STDERR}" "1")")
+    corr_array+=("Error: Directory is not empty.")
+
+    run_test ./test_fs.x info test.fs
+    line_array+=("$(select_line "${STDOUT}" "9")")
+    corr_array+=("fat_free_ratio=93/100")
+
+    # Emptied from the bottom up, every block comes back
+    run_tool ./test_fs.x rm test.fs dir1/sub/test-file-1
+    run_test ./test_fs.x rm test.fs dir1/sub
+    line_array+=("$(select_line "${STDOUT}" "1")")
+    corr_array+=("Removed file 'dir1/sub'")
+
+    run_test ./test_fs.x ls test.fs dir1/sub
+    line_array+=("$(select_line "${STDERR}" "1")")
+    corr_array+=("Error: Directory not found.")
+
+    run_tool ./test_fs.x rm test.fs dir1
+    run_test ./test_fs.x info test.fs
+    line_array+=("$(select_line "${STDOUT}" "9")")
+    corr_array+=("fat_free_ratio=99/100")
+
+    rm -rf test.fs dir1
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# two disks mounted at once through handles, one copied into the other
+two_disks() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_tool ./fs_format.x test.fs 100
+    run_tool ./fs_make.x other.fs 50
+    python3 -c "for i in range(8000): print(chr(97 + i % 26), end='')" > test-file-1
+    echo "hello" > test-file-2
+    run_tool ./test_fs.x add test.fs test-file-1
+    run_tool ./test_fs.x add test.fs test-file-2
+
+    local line_array=()
+    local corr_array=()
+
+    # Both instances hand out the same file descriptors
+    run_test ./test_fs.x copy test.fs other.fs test-file-1
+    line_array+=("$(select_line "${STDOUT}" "1")")
+    corr_array+=("Copied file 'test-file-1' (8000 bytes)")
+
+    # The source disk is left as it was
+    run_test ./test_fs.x ls test.fs
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    corr_array+=("file: test-file-1, size: 8000, data_blk: 1")
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    corr_array+=("file: test-file-2, size: 6, data_blk: 3")
+
+    run_test ./test_fs.x info test.fs
+    line_array+=("$(select_line "${STDOUT}" "9")")
+    corr_array+=("fat_free_ratio=96/100")
+
+    # The copy only holds the file copied into it
+    run_test ./test_fs.x info other.fs
+    line_array+=("$(select_line "${STDOUT}" "7")")
+    corr_array+=("fat_free_ratio=47/50")
+
+    run_test ./test_fs.x cat other.fs test-file-1
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    corr_array+=("$(cat test-file-1)")
+
+    run_test ./test_fs.x copy other.fs test.fs test-file-2
+    line_array+=("$(select_line "${STDERR}" "1")")
+    corr_array+=("Error: File not found.")
+
+    rm -f test.fs other.fs test-file-1 test-file-2
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# crash once the journal holds the metadata, but before it is written in place
+journal_replay() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_tool ./fs_format.x -e test.fs 10
+    python3 -c "for i in range(16384): print('a', end='')" > test-file-1
+    python3 -c "for i in range(32768): print('b', end='')" > test-file-2
+
+    # The second file needs the blocks of the first one, whose extent block
+    # the second transaction revokes before it ends up holding file data
+    cat <<END_SCRIPT > journal_replay.script
+MOUNT
+CREATE	test-file-1
+OPEN	test-file-1
+WRITE	FILE	test-file-1
+CLOSE
+SYNC
+DELETE	test-file-1
+CREATE	test-file-2
+OPEN	test-file-2
+WRITE	FILE	test-file-2
+CLOSE
+SYNC
+CRASH
+END_SCRIPT
+    run_tool ./test_fs.x script test.fs journal_replay.script
+
+    local line_array=()
+    local corr_array=()
+
+    run_test ./test_fs.x info test.fs
+    line_array+=("$(select_line "${STDOUT}" "9")")
+    corr_array+=("fat_free_ratio=0/10")
+
+    run_test ./test_fs.x ls test.fs
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    corr_array+=("file: test-file-2, size: 32768, data_blk: 1")
+
+    cat <<END_SCRIPT > journal_replay.script
+MOUNT
+OPEN	test-file-2
+READ	32768	FILE	test-file-2
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs journal_replay.script
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    corr_array+=("Read 32768 bytes from file. Compared 32768 correct.")
+
+    rm -f test.fs test-file-1 test-file-2 journal_replay.script
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# crash while reusing the blocks of a file deleted since the last sync
+journal_freed() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_tool ./fs_format.x -e test.fs 10
+    python3 -c "for i in range(16384): print('a', end='')" > test-file-1
+    python3 -c "for i in range(32768): print('b', end='')" > test-file-2
+
+    # The blocks of the first file are only handed to the second one once
+    # the delete is committed, which happens before the write starts. The
+    # write itself is not committed, so the crash leaves an empty file and
+    # every block free.
+    cat <<END_SCRIPT > journal_freed.script
+MOUNT
+CREATE	test-file-1
+OPEN	test-file-1
+WRITE	FILE	test-file-1
+CLOSE
+SYNC
+DELETE	test-file-1
+CREATE	test-file-2
+OPEN	test-file-2
+WRITE	FILE	test-file-2
+CLOSE
+CRASH
+END_SCRIPT
+    run_tool ./test_fs.x script test.fs journal_freed.script
+
+    local line_array=()
+    local corr_array=()
+
+    run_test ./test_fs.x info test.fs
+    line_array+=("$(select_line "${STDOUT}" "9")")
+    corr_array+=("fat_free_ratio=9/10")
+
+    run_test ./test_fs.x ls test.fs
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    corr_array+=("file: test-file-2, size: 0, data_blk: 4294967295")
+
+    rm -f test.fs test-file-1 test-file-2 journal_freed.script
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
 #
 # Run tests
 #
@@ -374,6 +708,19 @@ run_tests() {
     # Phase 3+4
     read_block
     overwrite_block
+    # Backends
+    mmap_backend
+    # Preallocation
+    fallocate_run
+    # Extents
+    extents_full
+    # Directories
+    directories
+    # Instances
+    two_disks
+    # Journal
+    journal_replay
+    journal_freed
 }
 
 make_fs() {
@@ -381,7 +728,7 @@ make_fs() {
     make > /dev/null 2>&1 ||
         die "Compilation failed"
 
-    local execs=("test_fs.x" "fs_make.x" "fs_ref.x")
+    local execs=("test_fs.x" "fs_make.x" "fs_ref.x" "fs_format.x")
 
     # Make sure executables were properly created
     local x
@@ -0,0 +1,742 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* End of a hash chain / empty bucket */
+#define NO_SLOT -1
+
+/* Disk reads started at once by cache_read_ranges() */
+#define RANGES_BATCH 32
+
+/* Returned by claim() when it released the lock to write back a victim */
+#define CLAIM_AGAIN -2
+
+/* One cached block */
+struct cache_slot {
+	/* Disk block held by this slot */
+	size_t block;
+	/* Slot holds a block */
+	int valid;
+	/* Slot differs from disk */
+	int dirty;
+	/* CLOCK reference bit */
+	int referenced;
+	/* Block being loaded or written back without the lock, see claim() */
+	int busy;
+	/* What the block holds, see cache_sync_kind() */
+	enum cache_kind kind;
+	/* Next slot in the same hash bucket */
+	int next;
+};
+
+/* Disk read started by cache_prefetch(), copied into the cache on completion */
+struct prefetch {
+	struct block_request req;
+	struct cache *cache;
+	/* A block of the range was written since, the data read is dropped */
+	int stale;
+	struct prefetch *next;
+	/* req.count blocks */
+	uint8_t data[];
+};
+
+/* Cache instance description */
+struct cache {
+	/* Disk the cached blocks belong to */
+	struct disk *disk;
+	/* Number of slots */
+	size_t nslots;
+	/* Slot metadata and data (nslots * BLOCK_SIZE bytes) */
+	struct cache_slot *slots;
+	uint8_t *data;
+	/* Hash buckets, power of two sized */
+	int *buckets;
+	size_t nbuckets;
+	/* CLOCK hand */
+	size_t hand;
+	/* Prefetches in flight */
+	struct prefetch *prefetching;
+	/*
+	 * Held while slots are looked up or changed. Disk transfers are done
+	 * without it, so that threads working on different blocks do not wait on
+	 * each other: a slot whose block is being loaded or written back is busy,
+	 * and waited for through @ready.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	/* Busy slots, and how many of them are being written back */
+	size_t nbusy;
+	size_t writing;
+};
+
+static size_t bucket_of(struct cache *cache, size_t block)
+{
+	return (block * 2654435761u) & (cache->nbuckets - 1);
+}
+
+static uint8_t *slot_data(struct cache *cache, int slot)
+{
+	return cache->data + (size_t)slot * BLOCK_SIZE;
+}
+
+static int lookup(struct cache *cache, size_t block)
+{
+	int slot = cache->buckets[bucket_of(cache, block)];
+
+	while (slot != NO_SLOT && cache->slots[slot].block != block)
+		slot = cache->slots[slot].next;
+
+	return slot;
+}
+
+/* Slot holding @block, waiting for it to stop being busy */
+static int lookup_ready(struct cache *cache, size_t block)
+{
+	int slot;
+
+	while ((slot = lookup(cache, block)) != NO_SLOT &&
+	       cache->slots[slot].busy)
+		pthread_cond_wait(&cache->ready, &cache->lock);
+
+	return slot;
+}
+
+/* Hand a busy slot over to the threads waiting for it */
+static void publish(struct cache *cache, int slot)
+{
+	cache->slots[slot].busy = 0;
+	cache->nbusy--;
+	pthread_cond_broadcast(&cache->ready);
+}
+
+static void unlink_slot(struct cache *cache, int slot)
+{
+	int *link = &cache->buckets[bucket_of(cache, cache->slots[slot].block)];
+
+	while (*link != slot)
+		link = &cache->slots[*link].next;
+	*link = cache->slots[slot].next;
+}
+
+/* Make prefetches of blocks overwritten from @block on drop what they read */
+static void prefetch_stale(struct cache *cache, size_t block, size_t count)
+{
+	struct prefetch *p;
+
+	for (p = cache->prefetching; p; p = p->next) {
+		if (block < p->req.block + p->req.count &&
+		    p->req.block < block + count)
+			p->stale = 1;
+	}
+}
+
+static int writeback(struct cache *cache, int slot)
+{
+	if (!cache->slots[slot].dirty)
+		return 0;
+
+	if (block_write_h(cache->disk, cache->slots[slot].block,
+			  slot_data(cache, slot)) == -1)
+		return -1;
+
+	/* The block may be evicted before a prefetch of its old content ends */
+	prefetch_stale(cache, cache->slots[slot].block, 1);
+	cache->slots[slot].dirty = 0;
+	return 0;
+}
+
+/* Write dirty @slot back, releasing the lock meanwhile */
+static int writeback_unlocked(struct cache *cache, int slot)
+{
+	struct cache_slot *s = &cache->slots[slot];
+	int ret;
+
+	s->busy = 1;
+	cache->nbusy++;
+	cache->writing++;
+	pthread_mutex_unlock(&cache->lock);
+	ret = block_write_h(cache->disk, s->block, slot_data(cache, slot));
+	pthread_mutex_lock(&cache->lock);
+	cache->writing--;
+
+	if (ret == 0) {
+		prefetch_stale(cache, s->block, 1);
+		s->dirty = 0;
+	}
+	publish(cache, slot);
+
+	return ret;
+}
+
+/*
+ * Pick a slot for @block with the CLOCK algorithm. Dirty metadata is passed
+ * over until two sweeps find nothing else. The slot is returned busy, to be
+ * filled by the caller and handed over with publish(). A dirty victim is
+ * written back first, and CLAIM_AGAIN returned: @block may have been cached
+ * by another thread meanwhile.
+ */
+static int claim(struct cache *cache, size_t block)
+{
+	struct cache_slot *s;
+	size_t scanned = 0;
+	int slot;
+
+	while (cache->nbusy == cache->nslots)
+		pthread_cond_wait(&cache->ready, &cache->lock);
+
+	for (;; scanned++) {
+		slot = cache->hand;
+		cache->hand = (cache->hand + 1) % cache->nslots;
+		s = &cache->slots[slot];
+
+		if (!s->valid)
+			break;
+		if (s->busy)
+			continue;
+		if (s->referenced) {
+			s->referenced = 0;
+			continue;
+		}
+		if (s->dirty && s->kind != CACHE_DATA &&
+		    scanned < 2 * cache->nslots)
+			continue;
+		if (s->dirty)
+			return writeback_unlocked(cache, slot) == -1 ?
+			       NO_SLOT : CLAIM_AGAIN;
+		unlink_slot(cache, slot);
+		break;
+	}
+
+	s->block = block;
+	s->valid = 1;
+	s->dirty = 0;
+	s->referenced = 1;
+	s->busy = 1;
+	s->kind = CACHE_DATA;
+	s->next = cache->buckets[bucket_of(cache, block)];
+	cache->buckets[bucket_of(cache, block)] = slot;
+	cache->nbusy++;
+
+	return slot;
+}
+
+static int slot_cmp(const void *a, const void *b)
+{
+	size_t x = (*(struct cache_slot *const *)a)->block;
+	size_t y = (*(struct cache_slot *const *)b)->block;
+
+	return (x > y) - (x < y);
+}
+
+static void drop(struct cache *cache, int slot)
+{
+	unlink_slot(cache, slot);
+	cache->slots[slot].valid = 0;
+	if (cache->slots[slot].busy)
+		publish(cache, slot);
+}
+
+/* Wait for the write backs done without the lock to complete */
+static void wait_writing(struct cache *cache)
+{
+	while (cache->writing)
+		pthread_cond_wait(&cache->ready, &cache->lock);
+}
+
+struct cache *cache_open(struct disk *disk, size_t nblocks)
+{
+	struct cache *cache = calloc(1, sizeof(*cache));
+
+	if (!cache) {
+		cache_error("unable to allocate cache");
+		return NULL;
+	}
+
+	cache->disk = disk;
+	cache->nslots = nblocks;
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->ready, NULL);
+
+	if (!nblocks)
+		return cache;
+
+	cache->nbuckets = 1;
+	while (cache->nbuckets < 2 * nblocks)
+		cache->nbuckets <<= 1;
+
+	cache->slots = calloc(nblocks, sizeof(struct cache_slot));
+	cache->data = malloc(nblocks * BLOCK_SIZE);
+	cache->buckets = malloc(cache->nbuckets * sizeof(int));
+	if (!cache->slots || !cache->data || !cache->buckets) {
+		cache_error("unable to allocate %zu blocks", nblocks);
+		cache->nslots = 0;
+		cache_close(cache);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < cache->nbuckets; i++)
+		cache->buckets[i] = NO_SLOT;
+
+	return cache;
+}
+
+int cache_close(struct cache *cache)
+{
+	int ret;
+
+	if (!cache) {
+		cache_error("no cache currently open");
+		return -1;
+	}
+
+	ret = cache_sync(cache);
+
+	pthread_mutex_destroy(&cache->lock);
+	pthread_cond_destroy(&cache->ready);
+	free(cache->slots);
+	free(cache->data);
+	free(cache->buckets);
+	free(cache);
+
+	return ret;
+}
+
+int cache_read(struct cache *cache, size_t block, void *buf)
+{
+	int slot, ret;
+
+	if (!cache->nslots)
+		return block_read_h(cache->disk, block, buf);
+
+	pthread_mutex_lock(&cache->lock);
+	while ((slot = lookup_ready(cache, block)) == NO_SLOT) {
+		slot = claim(cache, block);
+		if (slot == NO_SLOT) {
+			pthread_mutex_unlock(&cache->lock);
+			return -1;
+		}
+		if (slot == CLAIM_AGAIN)
+			continue;
+
+		/* Other readers of the block wait for the slot meanwhile */
+		pthread_mutex_unlock(&cache->lock);
+		ret = block_read_h(cache->disk, block, slot_data(cache, slot));
+		pthread_mutex_lock(&cache->lock);
+		if (ret == -1) {
+			drop(cache, slot);
+			pthread_mutex_unlock(&cache->lock);
+			return -1;
+		}
+		publish(cache, slot);
+		break;
+	}
+
+	cache->slots[slot].referenced = 1;
+	memcpy(buf, slot_data(cache, slot), BLOCK_SIZE);
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+int cache_write(struct cache *cache, size_t block, const void *buf)
+{
+	return cache_write_kind(cache, block, buf, CACHE_DATA);
+}
+
+int cache_write_kind(struct cache *cache, size_t block, const void *buf,
+		     enum cache_kind kind)
+{
+	int slot;
+
+	if (!cache->nslots)
+		return block_write_h(cache->disk, block, buf);
+
+	if (block >= (size_t)block_disk_count_h(cache->disk)) {
+		cache_error("block index out of bounds (%zu)", block);
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	prefetch_stale(cache, block, 1);
+	while ((slot = lookup_ready(cache, block)) == NO_SLOT) {
+		slot = claim(cache, block);
+		if (slot == NO_SLOT) {
+			pthread_mutex_unlock(&cache->lock);
+			return -1;
+		}
+		if (slot != CLAIM_AGAIN) {
+			publish(cache, slot); /* Filled below, before unlocking */
+			break;
+		}
+	}
+
+	cache->slots[slot].referenced = 1;
+	cache->slots[slot].dirty = 1;
+	cache->slots[slot].kind = kind;
+	memcpy(slot_data(cache, slot), buf, BLOCK_SIZE);
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+/* Read @count uncached blocks from disk, straight into @buf */
+static int read_direct(struct cache *cache, size_t block, size_t count,
+		       uint8_t *buf)
+{
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = count * BLOCK_SIZE,
+	};
+
+	return block_readv_h(cache->disk, block, &iov, 1);
+}
+
+int cache_read_range(struct cache *cache, size_t block, size_t count,
+		     void *buf)
+{
+	uint8_t *dst = buf;
+	size_t run = 0;
+	int slot;
+
+	if (count == 1)
+		return cache_read(cache, block, buf);
+	if (!cache->nslots)
+		return read_direct(cache, block, count, dst);
+
+	for (size_t i = 0; i < count; i++) {
+		pthread_mutex_lock(&cache->lock);
+		slot = lookup_ready(cache, block + i);
+		if (slot != NO_SLOT) {
+			cache->slots[slot].referenced = 1;
+			memcpy(dst + i * BLOCK_SIZE, slot_data(cache, slot), BLOCK_SIZE);
+		}
+		pthread_mutex_unlock(&cache->lock);
+
+		if (slot == NO_SLOT) {
+			run++;
+			continue;
+		}
+
+		/* Flush the uncached run that ends here */
+		if (run && read_direct(cache, block + i - run, run,
+				       dst + (i - run) * BLOCK_SIZE) == -1)
+			return -1;
+		run = 0;
+	}
+
+	if (run && read_direct(cache, block + count - run, run,
+			       dst + (count - run) * BLOCK_SIZE) == -1)
+		return -1;
+
+	return 0;
+}
+
+/* Start the reads of @batch and wait for all reads of @queue to complete */
+static int read_batch(struct block_queue *queue, struct block_request **batch,
+		      int n)
+{
+	int ret = 0;
+
+	if (block_queue_submit(queue, batch, n) == -1)
+		return -1;
+
+	while (block_queue_pending(queue))
+		block_queue_complete(queue, block_queue_pending(queue));
+
+	for (int i = 0; i < n; i++) {
+		if (batch[i]->result == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+int cache_read_ranges(struct cache *cache, struct block_queue *queue,
+		      const struct cache_range *ranges, int n)
+{
+	struct block_request reqs[RANGES_BATCH];
+	struct block_request *batch[RANGES_BATCH];
+	int nreqs = 0, ret = 0;
+	uint8_t *dst;
+	size_t run;
+	int slot;
+
+	if (!queue || n == 1) {
+		for (int r = 0; r < n; r++) {
+			if (cache_read_range(cache, ranges[r].block,
+					     ranges[r].count, ranges[r].buf) == -1)
+				return -1;
+		}
+		return 0;
+	}
+
+	for (int r = 0; r < n; r++) {
+		dst = ranges[r].buf;
+		run = 0;
+
+		/* One more step past the range, to queue its last run */
+		for (size_t i = 0; i <= ranges[r].count; i++) {
+			slot = NO_SLOT;
+			if (i < ranges[r].count && cache->nslots) {
+				pthread_mutex_lock(&cache->lock);
+				slot = lookup_ready(cache, ranges[r].block + i);
+				if (slot != NO_SLOT) {
+					cache->slots[slot].referenced = 1;
+					memcpy(dst + i * BLOCK_SIZE,
+					       slot_data(cache, slot), BLOCK_SIZE);
+				}
+				pthread_mutex_unlock(&cache->lock);
+			}
+
+			if (i < ranges[r].count && slot == NO_SLOT) {
+				run++;
+				continue;
+			}
+			if (!run)
+				continue;
+
+			if (nreqs == RANGES_BATCH) {
+				if (read_batch(queue, batch, nreqs) == -1)
+					ret = -1;
+				nreqs = 0;
+			}
+			memset(&reqs[nreqs], 0, sizeof(reqs[nreqs]));
+			reqs[nreqs].block = ranges[r].block + i - run;
+			reqs[nreqs].count = run;
+			reqs[nreqs].buf = dst + (i - run) * BLOCK_SIZE;
+			batch[nreqs] = &reqs[nreqs];
+			nreqs++;
+			run = 0;
+		}
+	}
+
+	if (nreqs && read_batch(queue, batch, nreqs) == -1)
+		ret = -1;
+
+	return ret;
+}
+
+/*
+ * Give the cached copies of @count blocks from @block the content of @src,
+ * clean. Prefetches in flight may have read the old content and are dropped.
+ * Unless @all, copies dirtied by another writer are left alone.
+ */
+static void refresh(struct cache *cache, size_t block, size_t count,
+		    const uint8_t *src, int all)
+{
+	int slot;
+
+	pthread_mutex_lock(&cache->lock);
+	prefetch_stale(cache, block, count);
+	for (size_t i = 0; i < count && cache->nslots; i++) {
+		slot = lookup_ready(cache, block + i);
+		if (slot == NO_SLOT || (!all && cache->slots[slot].dirty))
+			continue;
+
+		memcpy(slot_data(cache, slot), src + i * BLOCK_SIZE, BLOCK_SIZE);
+		cache->slots[slot].dirty = 0;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+int cache_write_range(struct cache *cache, size_t block, size_t count,
+		      const void *buf)
+{
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = count * BLOCK_SIZE,
+	};
+
+	if (count == 1)
+		return cache_write(cache, block, buf);
+
+	/*
+	 * Cached copies are updated before the write, so that evicting an old
+	 * dirty one cannot put its content back over the new one, and after, as
+	 * blocks read while the write was in flight may hold the old content.
+	 */
+	refresh(cache, block, count, buf, 1);
+	if (block_writev_h(cache->disk, block, &iov, 1) == -1)
+		return -1;
+	refresh(cache, block, count, buf, 0);
+
+	return 0;
+}
+
+static void prefetch_done(struct block_request *req)
+{
+	struct prefetch *p = req->data;
+	struct cache *cache = p->cache;
+	struct prefetch **link = &cache->prefetching;
+	int slot;
+
+	pthread_mutex_lock(&cache->lock);
+	for (size_t i = 0; i < req->count && !p->stale && !req->result; i++) {
+		slot = CLAIM_AGAIN;
+		while (slot == CLAIM_AGAIN &&
+		       lookup(cache, req->block + i) == NO_SLOT)
+			slot = claim(cache, req->block + i);
+		if (slot == NO_SLOT)
+			break;
+		if (slot == CLAIM_AGAIN)
+			continue;
+
+		/* Claiming may release the lock, and let a write go through */
+		if (p->stale) {
+			drop(cache, slot);
+			break;
+		}
+
+		/* Left for the next CLOCK sweep to evict if it is never read */
+		cache->slots[slot].referenced = 0;
+		memcpy(slot_data(cache, slot), p->data + i * BLOCK_SIZE,
+		       BLOCK_SIZE);
+		publish(cache, slot);
+	}
+
+	/* Only now, so that writes made while claiming mark it stale */
+	while (*link != p)
+		link = &(*link)->next;
+	*link = p->next;
+	pthread_mutex_unlock(&cache->lock);
+
+	free(p);
+}
+
+int cache_prefetch(struct cache *cache, struct block_queue *queue,
+		   size_t block, size_t count)
+{
+	struct block_request *req;
+	struct prefetch *p;
+
+	/* Nowhere to put the blocks, or no need to */
+	if (!queue || !cache->nslots || block_map_h(cache->disk, block, count))
+		return 0;
+
+	if (count > cache->nslots / 2)
+		count = cache->nslots / 2;
+
+	/* Skip the blocks already cached at the start of the range */
+	pthread_mutex_lock(&cache->lock);
+	while (count && lookup(cache, block) != NO_SLOT) {
+		block++;
+		count--;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	if (!count)
+		return 0;
+
+	p = malloc(sizeof(*p) + count * BLOCK_SIZE);
+	if (!p) {
+		cache_error("unable to allocate %zu blocks", count);
+		return -1;
+	}
+	memset(p, 0, sizeof(*p));
+	p->req.block = block;
+	p->req.count = count;
+	p->req.buf = p->data;
+	p->req.done = prefetch_done;
+	p->req.data = p;
+	p->cache = cache;
+
+	pthread_mutex_lock(&cache->lock);
+	p->next = cache->prefetching;
+	cache->prefetching = p;
+	pthread_mutex_unlock(&cache->lock);
+
+	req = &p->req;
+	if (block_queue_submit(queue, &req, 1) == -1) {
+		p->stale = 1;
+		prefetch_done(req);
+		return -1;
+	}
+
+	return 0;
+}
+
+const void *cache_map_range(struct cache *cache, size_t block, size_t count)
+{
+	pthread_mutex_lock(&cache->lock);
+	for (size_t i = 0; i < count && cache->nslots; i++) {
+		if (lookup(cache, block + i) != NO_SLOT) {
+			pthread_mutex_unlock(&cache->lock);
+			return NULL;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return block_map_h(cache->disk, block, count);
+}
+
+int cache_sync(struct cache *cache)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	wait_writing(cache);
+	for (size_t i = 0; i < cache->nslots; i++) {
+		if (cache->slots[i].valid && writeback(cache, i) == -1)
+			ret = -1;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return ret;
+}
+
+size_t cache_dirty(struct cache *cache, enum cache_kind kind)
+{
+	size_t count = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	for (size_t i = 0; i < cache->nslots; i++) {
+		if (cache->slots[i].valid && cache->slots[i].dirty &&
+		    cache->slots[i].kind == kind)
+			count++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return count;
+}
+
+ssize_t cache_sync_kind(struct cache *cache, enum cache_kind kind)
+{
+	struct cache_slot **dirty;
+	ssize_t written = 0;
+	size_t n = 0;
+	int failed = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	wait_writing(cache);
+	dirty = malloc(cache->nslots * sizeof(*dirty));
+	if (cache->nslots && !dirty) {
+		pthread_mutex_unlock(&cache->lock);
+		return -1;
+	}
+	for (size_t i = 0; i < cache->nslots; i++) {
+		struct cache_slot *s = &cache->slots[i];
+
+		if (s->valid && s->dirty && s->kind == kind)
+			dirty[n++] = s;
+	}
+
+	/* In block order, so that the disk sees a single sweep */
+	qsort(dirty, n, sizeof(*dirty), slot_cmp);
+	for (size_t i = 0; i < n; i++) {
+		if (writeback(cache, dirty[i] - cache->slots) == -1)
+			failed = 1;
+		else
+			written++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	free(dirty);
+
+	return failed ? -1 : written;
+}
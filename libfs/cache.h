@@ -0,0 +1,221 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+#include <sys/types.h> /* for ssize_t definition */
+
+#include "disk.h"
+
+/** Number of blocks cached when the caller does not pick a size */
+#define CACHE_DEFAULT_BLOCKS 256
+
+/** Block cache, see cache_open() */
+struct cache;
+
+/**
+ * What a cached block holds. cache_sync_kind() writes each kind back on its
+ * own, so that blocks can reach the disk before those that refer to them.
+ */
+enum cache_kind {
+	/** File data, the kind of blocks written by cache_write() */
+	CACHE_DATA,
+	/** Allocation metadata (FAT, extent lists), referring to data */
+	CACHE_ALLOC,
+	/** Directory entries, referring to allocation metadata */
+	CACHE_DIR,
+};
+
+/**
+ * cache_open - Set up a block cache
+ * @disk: Disk whose blocks are cached, see block_disk_open_h()
+ * @nblocks: Number of %BLOCK_SIZE slots to allocate
+ *
+ * Allocate a write-back block cache of @nblocks blocks sitting on top of disk
+ * @disk. A cache of 0 blocks is valid and makes every cache_read() and
+ * cache_write() go straight to the disk. Each disk gets its own cache, and a
+ * cache may be used from several threads at once.
+ *
+ * Return: NULL if the cache cannot be allocated. Otherwise the cache, passed
+ * as @cache to the other functions.
+ */
+struct cache *cache_open(struct disk *disk, size_t nblocks);
+
+/**
+ * cache_close - Flush and release a block cache
+ * @cache: Cache to release
+ *
+ * Write every dirty block back to disk and free the cache. The disk stays open.
+ * Queues with prefetches in flight must be closed first.
+ *
+ * Return: -1 if @cache is NULL or if a dirty block cannot be written back. 0
+ * otherwise.
+ */
+int cache_close(struct cache *cache);
+
+/**
+ * cache_read - Read a block through the cache
+ * @cache: Cache to go through
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Copy block @block into @buf, loading it from disk on a miss. The least
+ * recently referenced block (CLOCK approximation) is evicted to make room, and
+ * written back first if it is dirty.
+ *
+ * Return: -1 if the block cannot be read. 0 otherwise.
+ */
+int cache_read(struct cache *cache, size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @cache: Cache to go through
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Store @buf as the new content of block @block and mark it dirty. The disk is
+ * only updated when the block is evicted or on cache_sync().
+ *
+ * Return: -1 if the block cannot be written. 0 otherwise.
+ */
+int cache_write(struct cache *cache, size_t block, const void *buf);
+
+/**
+ * cache_write_kind - Write a block holding metadata through the cache
+ * @cache: Cache to go through
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ * @kind: What the block holds
+ *
+ * Same as cache_write(), which writes %CACHE_DATA blocks. Dirty metadata
+ * blocks are only evicted when nothing else can be, so that they normally
+ * reach the disk through cache_sync_kind(), after the blocks they refer to.
+ *
+ * Return: -1 if the block cannot be written. 0 otherwise.
+ */
+int cache_write_kind(struct cache *cache, size_t block, const void *buf,
+		     enum cache_kind kind);
+
+/**
+ * cache_read_range - Read consecutive blocks through the cache
+ * @cache: Cache to go through
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer of @count * %BLOCK_SIZE bytes
+ *
+ * Blocks already cached are copied from the cache. Every run of uncached blocks
+ * is read from disk with a single vectored read straight into @buf, without
+ * being inserted in the cache, so that streaming reads do not evict hot blocks.
+ * A single block is simply read with cache_read().
+ *
+ * Return: -1 if a block cannot be read. 0 otherwise.
+ */
+int cache_read_range(struct cache *cache, size_t block, size_t count,
+		     void *buf);
+
+/** Consecutive blocks to read, see cache_read_ranges() */
+struct cache_range {
+	/** Index of the first block */
+	size_t block;
+	/** Number of blocks */
+	size_t count;
+	/** Data buffer of @count * %BLOCK_SIZE bytes */
+	void *buf;
+};
+
+/**
+ * cache_read_ranges - Read several ranges of blocks through the cache at once
+ * @cache: Cache to go through
+ * @queue: Queue the disk reads go through, see block_queue_open_h(), or NULL
+ * @ranges: Ranges to read
+ * @n: Number of ranges in @ranges
+ *
+ * Same as cache_read_range() on each range, except that the runs of uncached
+ * blocks of all the ranges are read from disk together, as asynchronous
+ * requests on @queue. Every request in flight on @queue has completed when
+ * this returns. Without a queue, the ranges are read one after the other.
+ *
+ * Return: -1 if a block cannot be read. 0 otherwise.
+ */
+int cache_read_ranges(struct cache *cache, struct block_queue *queue,
+		      const struct cache_range *ranges, int n);
+
+/**
+ * cache_write_range - Write consecutive blocks through the cache
+ * @cache: Cache to go through
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer of @count * %BLOCK_SIZE bytes
+ *
+ * Write the whole range to disk with a single vectored write. Cached copies of
+ * the blocks are refreshed and left clean. A single block is simply written
+ * with cache_write().
+ *
+ * Return: -1 if the blocks cannot be written. 0 otherwise.
+ */
+int cache_write_range(struct cache *cache, size_t block, size_t count,
+		      const void *buf);
+
+/**
+ * cache_prefetch - Start loading consecutive blocks into the cache
+ * @cache: Cache to load the blocks into
+ * @queue: Queue the disk read goes through, see block_queue_open_h()
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Start reading blocks @block to @block + @count - 1 from disk in the
+ * background, skipping those already cached at the start of the range. At
+ * most half the cache is loaded at once. The blocks are inserted in the cache
+ * when the read is collected with block_queue_complete() on @queue, except
+ * for those cached by then, and unless one of the blocks was written in the
+ * meantime. Nothing is read without a queue, on a cache of 0 blocks, or on a
+ * memory-mapped disk.
+ *
+ * Return: -1 if the read cannot be started. 0 otherwise.
+ */
+int cache_prefetch(struct cache *cache, struct block_queue *queue,
+		   size_t block, size_t count);
+
+/**
+ * cache_map_range - Get zero-copy access to consecutive blocks
+ * @cache: Cache to go through
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Return: NULL if the disk is not memory-mapped, or if one of the blocks is
+ * held by the cache (the mapping may then be stale). Otherwise a pointer to
+ * the blocks in the disk mapping, as returned by block_map().
+ */
+const void *cache_map_range(struct cache *cache, size_t block, size_t count);
+
+/**
+ * cache_sync - Write back all dirty blocks
+ * @cache: Cache to flush
+ *
+ * Return: -1 if a dirty block cannot be written back. 0 otherwise.
+ */
+int cache_sync(struct cache *cache);
+
+/**
+ * cache_dirty - Count dirty blocks of a kind
+ * @cache: Cache to look at
+ * @kind: Kind of blocks to count
+ *
+ * Return: the number of dirty blocks last written as @kind.
+ */
+size_t cache_dirty(struct cache *cache, enum cache_kind kind);
+
+/**
+ * cache_sync_kind - Write back the dirty blocks of a kind
+ * @cache: Cache to flush
+ * @kind: Kind of blocks to write back
+ *
+ * Write back the dirty blocks last written as @kind, in block order. Blocks
+ * are only handed to the disk file, see block_disk_sync() to make them
+ * durable.
+ *
+ * Return: -1 if a dirty block cannot be written back. Otherwise the number of
+ * blocks written back.
+ */
+ssize_t cache_sync_kind(struct cache *cache, enum cache_kind kind);
+
+#endif /* _CACHE_H */
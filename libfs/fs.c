@@ -1,25 +1,59 @@
 #include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "cache.h"
 #include "disk.h"
 #include "fs.h"
+#include "journal.h"
 
 #define SIGNATURE "ECS150FS"
 #define SIGNATURE_LENGTH 8
-#define ROOT_PADDING 10
-#define SUPERBLOCK_PADDING 4079
+#define ROOT_PADDING 9
+#define ROOT32_PADDING 3
+#define SUPERBLOCK_PADDING 4045
+#define SUPERBLOCK_CLEAN 0xC1 // Free block summary of the superblock is up to date
 #define MAX_ROOT_ENTRIES 128
+#define LOADED_ENTRIES_MAX 1024 // Subdirectory entries held in memory at once
+#define TABLE_ENTRIES (MAX_ROOT_ENTRIES + LOADED_ENTRIES_MAX)
+#define ENTRY_SIZE (BLOCK_SIZE / MAX_ROOT_ENTRIES) // Every directory block holds MAX_ROOT_ENTRIES entries
+#define ENTRY_FILE 0
+#define ENTRY_DIRECTORY 1
+#define ROOT_DIR -1 // Directory of the root block's entries
 #define FAT_ENTRIES 8192
 #define BLOCK_SIZE 4096 
 #define MAX_FILENAME 16 
-#define FAT_EOC 0xFFFF 
+#define FAT_EOC 0xFFFFFFFF // End of chain, as handled in memory whatever the FAT width
+#define FAT16_EOC 0xFFFF
+#define FAT_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
+#define FAT32_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define VERSION_FAT16 0 // Left zero by fs_make.x
+#define VERSION_FAT32 1 // Made by fs_format.x
+#define VERSION_EXTENTS 2 // Made by fs_format.x -e: 32-bit FAT used as allocation map, files made of extents
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / sizeof(uint64_t) - 1)
+#define RUN_MAX_BLOCKS 32
+#define READ_BATCH_RUNS 16 // Runs whose whole blocks one fs_read() reads together
+#define READAHEAD_MIN 4 // Blocks read ahead once a descriptor reads sequentially
+#define READAHEAD_MAX 64 // Read-ahead window limit, in blocks
+#define PREALLOC_BLOCKS 16
+#define DIR_DEPTH_MAX 10 // Hash bits a subdirectory's header can pick buckets with
+#define DIR_BUCKETS_MAX (1 << DIR_DEPTH_MAX)
+#define DIR_GROW_BLOCKS (DIR_DEPTH_MAX + 2) // Most blocks a new entry adds to its directory
+#define OP_RETRY -2 // Operation turned back by op_reserve(), to run again after op_commit()
+#define NAME_INDEX_SIZE 4096 // Power of two, at least twice TABLE_ENTRIES
+#define NAME_INDEX_EMPTY -1
+#define FAT_SCAN_MIN_BLOCKS 64 // Fewest FAT blocks worth a thread of their own at mount
+#define FAT_SCAN_MAX_THREADS 16
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
-//superblock 
+//superblock, as stored in block 0
 typedef struct __attribute__((packed)) {
 	uint8_t signature[SIGNATURE_LENGTH]; 
 	uint16_t total_block_amount;
@@ -27,557 +61,3308 @@ typedef struct __attribute__((packed)) {
 	uint16_t data_block_index;
 	uint16_t data_block_amount;
 	uint8_t fat_block_amount;
+	uint8_t version;
+	// VERSION_FAT32 geometry; the 16-bit fields above are then left zero
+	uint32_t total_block_amount32;
+	uint32_t root_block_index32;
+	uint32_t data_block_index32;
+	uint32_t data_block_amount32;
+	uint32_t fat_block_amount32;
+	// Journal region reserved by fs_format.x, none if zero
+	uint32_t journal_block_index32;
+	uint32_t journal_block_amount32;
+	// Free data blocks, only valid if clean is SUPERBLOCK_CLEAN: written by
+	// fs_umount(), cleared by fs_mount()
+	uint32_t free_block_amount32;
+	uint8_t clean;
 	uint8_t padding[SUPERBLOCK_PADDING];
+} DiskSuperBlock;
+
+//superblock, whatever the version
+typedef struct {
+	uint8_t version;
+	uint32_t total_block_amount;
+	uint32_t root_block_index;
+	uint32_t data_block_index;
+	uint32_t data_block_amount;
+	uint32_t fat_block_amount;
+	uint32_t journal_block_index;
+	uint32_t journal_block_amount;
+	uint32_t free_block_amount; // Trusted only if clean is set
+	int clean;
 } SuperBlock;
 
-//single block of FAT
-typedef struct __attribute__((packed)) {
-	uint16_t entries[BLOCK_SIZE/2];
+//single block of FAT, with 16 or 32-bit entries depending on the version
+typedef union {
+	uint16_t entries[FAT_ENTRIES_PER_BLOCK];
+	uint32_t entries32[FAT32_ENTRIES_PER_BLOCK];
 } FAT;
 
+//root directory entry, as stored by each version
 typedef struct __attribute__((packed)) {
 	uint8_t file_name[MAX_FILENAME];
 	uint32_t file_size;
 	uint16_t first_data_block_index;
+	uint8_t type;
 	uint8_t padding[ROOT_PADDING];
+} RootEntry16;
+
+typedef struct __attribute__((packed)) {
+	uint8_t file_name[MAX_FILENAME];
+	uint64_t file_size;
+	uint32_t first_data_block_index;
+	uint8_t type;
+	uint8_t padding[ROOT32_PADDING];
+} RootEntry32;
+
+//directory entry, whatever the version
+typedef struct {
+	uint8_t file_name[MAX_FILENAME];
+	uint64_t file_size;
+	uint32_t first_data_block_index;
+	uint8_t type; // ENTRY_FILE or ENTRY_DIRECTORY
 } RootEntry;
 
+// First block of a subdirectory, telling which of the blocks that follow holds
+// the entries of each hash value, see dir_home()
+typedef struct __attribute__((packed)) {
+	uint32_t depth; // Low hash bits the buckets are picked by
+	uint16_t buckets[DIR_BUCKETS_MAX]; // Block of each value of those bits
+	uint8_t bucket_depth[DIR_BUCKETS_MAX]; // Low hash bits shared by the entries of block i + 1
+	uint8_t padding[BLOCK_SIZE - 4 - 3 * DIR_BUCKETS_MAX];
+} DirHeader;
+
+// Where a table entry comes from. Slots below MAX_ROOT_ENTRIES mirror the root
+// directory block, the others hold subdirectory entries loaded on demand.
+typedef struct {
+	int parent;    // Table index of the directory holding the entry, or ROOT_DIR
+	uint32_t refs; // Descriptors, lookups and child entries using a loaded entry
+	int dirty;     // Loaded entry changed, written back by flush_metadata()
+} EntryLink;
+
 typedef struct __attribute__((packed)) {
-	uint16_t offset;
-	uint8_t index;
+	uint64_t offset;
+	uint16_t index;
 	int in_use; 
+	uint32_t window_start; // Free blocks [window_start, window_end) are set
+	uint32_t window_end;   // aside for this file's next allocations
+	uint32_t cursor_logical; // Logical block cursor_block holds in the file,
+	uint32_t cursor_block;   // or FAT_EOC when the cursor is not set
+	uint8_t bounce[BLOCK_SIZE]; // Staging for partial blocks, kept across calls
+	struct block_queue *queue; // Opened by the first read spanning several runs
+	uint64_t ra_offset; // Where the previous read ended
+	uint32_t ra_window; // Blocks to keep read ahead of the offset, 0 when off
+	uint32_t ra_end;    // Logical blocks below ra_end were read ahead,
+	uint32_t ra_block;  // the last one being ra_block, or FAT_EOC if unknown
+	uint32_t wb_logical; // Logical block of the file whose content bounce
+	uint32_t wb_block;   // holds, on disk block wb_block, or FAT_EOC if none
+	int wb_dirty;        // bounce holds writes not yet passed to the cache
 } FileDescriptor;
 
-static  SuperBlock *super_block;
-static  FAT *fat_entries;
-static  RootEntry *RootEntryArray;
-static  FileDescriptor *fd_table[FS_OPEN_MAX_COUNT];
+// Whole blocks of the runs met so far by one fs_read() call, not read yet
+typedef struct {
+	struct cache_range ranges[READ_BATCH_RUNS];
+	int count;
+	int failed; // Reading them failed, none of them counts as read
+} ReadBatch;
 
-int free_memory(void) {
-    if (super_block) {
-        free(super_block);
-        super_block = NULL;
-    }
+// Logical -> physical block table of a file, built on its first random access
+typedef struct {
+	uint32_t *blocks; // NULL until built, and again once the chain changes
+	size_t length;    // Blocks in the chain when the table was built
+} ChainMap;
 
-    if (fat_entries) {
-        free(fat_entries);
-        fat_entries = NULL;
+// (start, length) run of data blocks owned by a file on a VERSION_EXTENTS disk
+typedef struct __attribute__((packed)) {
+	uint32_t start;
+	uint32_t length;
+} Extent;
+
+// Extent block of a file, the data block its root entry points to on a
+// VERSION_EXTENTS disk
+typedef struct __attribute__((packed)) {
+	uint32_t count;
+	uint32_t reserved;
+	Extent extents[EXTENTS_PER_BLOCK];
+} ExtentBlock;
+
+// Extents of a file in memory, loaded on first use
+typedef struct {
+	ExtentBlock block;
+	uint32_t logical[EXTENTS_PER_BLOCK + 1]; // First logical block of each extent, then the block count
+	int dirty;
+} ExtentList;
+
+// Everything about one mounted file system
+struct fs {
+	struct disk *disk;
+	struct cache *cache; // Every block access goes through it
+	struct journal *journal; // Metadata writes go through it, if the disk has one
+
+	SuperBlock *super_block;
+	FAT *fat_entries;
+	RootEntry *RootEntryArray; // Root directory, then loaded subdirectory entries
+	EntryLink entry_links[TABLE_ENTRIES];
+	FileDescriptor *fd_table[FS_OPEN_MAX_COUNT];
+
+	// One bit per data block, set when the block is free
+	uint64_t *free_bitmap;
+	size_t free_block_count;
+	uint32_t alloc_hint; // Next-fit: where the next free block search starts
+
+	// Blocks freed since the last journal commit, left out of the bitmap: the
+	// committed metadata still gives them to their old file until then
+	uint32_t *freed;
+	size_t freed_count, freed_size;
+
+	// (directory, filename) -> table entry hash table (linear probing), and one
+	// bit per table entry, set when the entry is free
+	int16_t name_index[NAME_INDEX_SIZE];
+	uint64_t free_entries[TABLE_ENTRIES / 64];
+
+	// FAT blocks read so far, see fat_load()
+	uint8_t *fat_loaded; // One flag per FAT block
+	pthread_mutex_t fat_load_lock;
+
+	// Metadata modified in memory, written back once by flush_metadata()
+	uint8_t *fat_dirty; // One flag per FAT block
+	int root_dirty;
+
+	// One chain map per table entry
+	ChainMap chain_maps[TABLE_ENTRIES];
+
+	// One extent list per table entry (VERSION_EXTENTS only)
+	ExtentList *extent_lists[TABLE_ENTRIES];
+
+	// Locks, always taken in this order:
+	// - dir_lock guards the entry table, the name index, the descriptor table and
+	//   directory contents. Calls on an open file hold it shared, so that the file
+	//   stays put; creating, deleting, opening and closing hold it exclusively.
+	// - file_locks guard a file's content, chain map, extent list and the offset
+	//   and cursor of its descriptors, so that different files proceed in parallel.
+	// - fat_lock guards the FAT, the allocator, entry sizes and first blocks, and
+	//   their write-back. Mapping blocks only needs it shared.
+	pthread_rwlock_t dir_lock;
+	pthread_mutex_t file_locks[TABLE_ENTRIES];
+	pthread_rwlock_t fat_lock;
+};
+
+// File system used by the calls without a handle, mounted by fs_mount()
+static  struct fs *default_fs;
+
+// Defined further down, used by the metadata write-back, sync and directory code
+int dir_store(struct fs *fs, int dir, const RootEntry *entry, int create);
+size_t file_extend(struct fs *fs, FileDescriptor *self, int index, uint32_t *last, size_t wanted);
+void freed_release(struct fs *fs);
+int meta_read(struct fs *fs, size_t block, void *buf);
+
+int free_memory(struct fs *fs) {
+    if (fs->super_block) {
+        free(fs->super_block);
+        fs->super_block = NULL;
     }
 
-    if (RootEntryArray) {
-        free(RootEntryArray);
-        RootEntryArray = NULL;
+    if (fs->fat_entries) {
+        free(fs->fat_entries);
+        fs->fat_entries = NULL;
     }
-}
 
-int fs_mount(const char *diskname)
-{
-	// Open virtual disk
-	if (block_disk_open(diskname) != 0) {
-		return -1;
-	}
-	// Read super_block at beginning of virtual disk
-	super_block = malloc(sizeof(SuperBlock));
-	if (!super_block || block_read(0, super_block) == -1) {
-        fprintf(stderr, "Error: unable to read the superblock from disk.\n");
-        free_memory();
-        block_disk_close();
-        return -1;
+    if (fs->RootEntryArray) {
+        free(fs->RootEntryArray);
+        fs->RootEntryArray = NULL;
     }
-	// Verify signature has correct signature
-	if (memcmp(super_block->signature, SIGNATURE, SIGNATURE_LENGTH) != 0) {
-		fprintf(stderr, "Error: disk signature doesn't match.\n");
-        free_memory();
-        block_disk_close();
-        return -1;
-	}
 
-	// Verify super_block has correct block amount
-	if (super_block->total_block_amount != block_disk_count()) {
-		fprintf(stderr, "Error: super_block has wrong block amount.\n");
-        free_memory();
-    	block_disk_close();
-		return -1;
-	}
+    if (fs->free_bitmap) {
+        free(fs->free_bitmap);
+        fs->free_bitmap = NULL;
+    }
 
-	// Read blocks into a FAT array
-	fat_entries = malloc(sizeof(FAT) * super_block->fat_block_amount);
-	if (!fat_entries) {
-        fprintf(stderr, "Error: unable to allocate memory for the FAT.\n");
-        free_memory();
-        block_disk_close();
-        return -1;
+    if (fs->fat_dirty) {
+        free(fs->fat_dirty);
+        fs->fat_dirty = NULL;
     }
 
-	// Read the FAT blocks from disk
-	for (int i = 0; i < super_block->fat_block_amount; i++) {
-		if (block_read(1 + i, &fat_entries[i]) == -1) {
-            free_memory();
-			return -1; // Handle read failure
-		}
-	}
+    free(fs->fat_loaded);
+    fs->fat_loaded = NULL;
 
-	// Allocate memory for the root directory entries
-    RootEntryArray = malloc(MAX_ROOT_ENTRIES * sizeof(RootEntry));
-    if (RootEntryArray == NULL) {
-        free_memory();
-        return -1; // Handle memory allocation failure
-    }	
+    free(fs->freed);
+    fs->freed = NULL;
+    fs->freed_count = fs->freed_size = 0;
+    fs->root_dirty = 0;
 
-	// Read the root directory block from disk
-    if (block_read(super_block->root_block_index, RootEntryArray) == -1) {
-        free_memory();
-        return -1;
+    for (int i = 0; i < TABLE_ENTRIES; i++) {
+        free(fs->chain_maps[i].blocks);
+        fs->chain_maps[i].blocks = NULL;
+        free(fs->extent_lists[i]);
+        fs->extent_lists[i] = NULL;
     }
 
-    // Initialize the file descriptor table
+    // Descriptors left open
     for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        fd_table[i] = NULL; // Set each file descriptor to NULL, indicating it's not in use
+        if (fs->fd_table[i] && fs->fd_table[i]->queue) {
+            block_queue_close(fs->fd_table[i]->queue);
+        }
+        free(fs->fd_table[i]);
+        fs->fd_table[i] = NULL;
     }
+}
 
-	return 0;
+// Namespace changes run alone, holding both the entry table and the allocator
+void namespace_lock(struct fs *fs) {
+    pthread_rwlock_wrlock(&fs->dir_lock);
+    pthread_rwlock_wrlock(&fs->fat_lock);
 }
 
-int is_mounted(void) {
-    return (super_block != NULL && fat_entries != NULL && RootEntryArray != NULL);
+void namespace_unlock(struct fs *fs) {
+    pthread_rwlock_unlock(&fs->fat_lock);
+    pthread_rwlock_unlock(&fs->dir_lock);
 }
 
-int fs_umount(void)
-{
-	if (!is_mounted()) {
-        fprintf(stderr, "Error: Filesystem is not mounted.\n");
-        return -1;
+// Note that table entry @index changed and must be written back
+void entry_dirty(struct fs *fs, int index) {
+    if (index < MAX_ROOT_ENTRIES) {
+        fs->root_dirty = 1;
+    } else {
+        fs->entry_links[index].dirty = 1;
     }
+}
 
-	// Free dynamically allocated memory
-    free_memory();
+// Whether table entry @index is waiting to be written back
+int entry_is_dirty(struct fs *fs, int index) {
+    return index < MAX_ROOT_ENTRIES ? fs->root_dirty : fs->entry_links[index].dirty;
+}
 
-    // Close virtual disk
-    if (block_disk_close() == -1) {
-        fprintf(stderr, "Error: Unable to close virtual disk.\n");
-		return -1; // Closing the virtual disk failed
-    }
+// Block number @value as stored in this disk's FAT and root directory
+uint32_t block_encode(struct fs *fs, uint32_t value) {
+    return value == FAT_EOC && fs->super_block->version == VERSION_FAT16 ? FAT16_EOC : value;
+}
 
-	return 0;
+// Block number read from this disk's FAT or root directory
+uint32_t block_decode(struct fs *fs, uint32_t value) {
+    return value == FAT16_EOC && fs->super_block->version == VERSION_FAT16 ? FAT_EOC : value;
 }
 
-int fs_info(void)
-{
-	if (!is_mounted()) {
-        fprintf(stderr, "Error: Filesystem is not mounted.\n");
-        return -1;
+// FAT entries held by one FAT block of this disk
+size_t fat_per_block(struct fs *fs) {
+    return fs->super_block->version != VERSION_FAT16 ? FAT32_ENTRIES_PER_BLOCK : FAT_ENTRIES_PER_BLOCK;
+}
+
+// Read FAT block @block on first use, and mark its free entries in the free
+// block bitmap. Blocks are loaded under either FAT lock mode, so loading is
+// serialized on its own lock, and the loaded flag published last.
+int fat_load(struct fs *fs, size_t block) {
+    if (__atomic_load_n(&fs->fat_loaded[block], __ATOMIC_ACQUIRE)) {
+        return 0;
     }
 
-    printf("FS Info:\n");
-    printf("total_blk_count=%d\n", super_block->total_block_amount);
-    printf("fat_blk_count=%d\n", super_block->fat_block_amount);
-    printf("rdir_blk=%d\n", super_block->root_block_index);
-    printf("data_blk=%d\n", super_block->data_block_index);
-    printf("data_blk_count=%d\n", super_block->data_block_amount);
-
-    // Count free blocks in the FAT
-    int free_fat_blocks = 0;
-    for (int i = 0; i < super_block->data_block_amount; i++) {
-		if (fat_entries->entries[i] == 0){
-			free_fat_blocks++;
-		}
-	}
+    pthread_mutex_lock(&fs->fat_load_lock);
+    if (!fs->fat_loaded[block]) {
+        if (meta_read(fs, 1 + block, &fs->fat_entries[block]) == -1) {
+            pthread_mutex_unlock(&fs->fat_load_lock);
+            fprintf(stderr, "Error: Unable to read FAT block %zu.\n", block);
+            return -1;
+        }
 
-    // Count free root directory entries
-    int free_root_entries = 0;
-    for (int i = 0; i < MAX_ROOT_ENTRIES; i++) {
-        if (RootEntryArray[i].file_name[0] == '\0') { // Assuming an empty filename indicates a free entry
-            free_root_entries++;
+        size_t perBlock = fat_per_block(fs);
+        size_t end = min((block + 1) * perBlock, (size_t)fs->super_block->data_block_amount);
+        for (size_t i = block * perBlock; i < end; i++) {
+            uint32_t value = fs->super_block->version != VERSION_FAT16 ? fs->fat_entries[block].entries32[i - block * perBlock]
+                                                                       : fs->fat_entries[block].entries[i - block * perBlock];
+            if (value == 0) {
+                fs->free_bitmap[i / 64] |= 1ULL << (i % 64);
+            }
         }
+        __atomic_store_n(&fs->fat_loaded[block], 1, __ATOMIC_RELEASE);
     }
+    pthread_mutex_unlock(&fs->fat_load_lock);
 
-    // Print the ratios of free FAT blocks to total data blocks, and free root directory entries to maximum root entries
-    printf("fat_free_ratio=%d/%d\n", free_fat_blocks, super_block->data_block_amount);
-    printf("rdir_free_ratio=%d/%d\n", free_root_entries, MAX_ROOT_ENTRIES);
-
-	return 0;
+    return 0;
 }
 
-int is_valid_filename(const char* filename) {
-    return (filename && strlen(filename) > 0 && strlen(filename) < MAX_FILENAME);
+// Make sure the FAT block covering free bitmap word @word is loaded
+void fat_load_word(struct fs *fs, size_t word) {
+    fat_load(fs, word * 64 / fat_per_block(fs));
 }
 
-int fs_create(const char *filename)
-{
-	if (!is_mounted()) {
-        fprintf(stderr, "Error: Filesystem is not mounted.\n");
-        return -1;
+// Next block in the chain after data block @index. A FAT block that cannot be
+// read ends every chain going through it.
+uint32_t fat_get(struct fs *fs, uint32_t index) {
+    if (fat_load(fs, index / fat_per_block(fs)) == -1) {
+        return FAT_EOC;
     }
-
-	if (!is_valid_filename(filename)) {
-        fprintf(stderr, "Error: Filename is invalid or too long.\n");
-        return -1;
+    if (fs->super_block->version != VERSION_FAT16) {
+        return fs->fat_entries[index / FAT32_ENTRIES_PER_BLOCK].entries32[index % FAT32_ENTRIES_PER_BLOCK];
     }
+    return block_decode(fs, fs->fat_entries[index / FAT_ENTRIES_PER_BLOCK].entries[index % FAT_ENTRIES_PER_BLOCK]);
+}
 
-	// Check for existing file with the same name
-    for (int i = 0; i < MAX_ROOT_ENTRIES; i++) {
-        if (strcmp((char *)RootEntryArray[i].file_name, filename) == 0) {
-            fprintf(stderr, "Error: File already exists.\n");
-            return -1;
-        }
+// Consecutive FAT blocks read and checked by one thread of fat_scan_all()
+struct fat_scan {
+    struct fs *fs;
+    size_t first, count;
+    size_t free, chains, bad; // Free entries, chain ends, links outside the data blocks
+    int ret;
+};
+
+// Read the FAT blocks of @arg straight into the FAT array, then mark their free
+// entries in the free block bitmap. Slices start on a FAT block and every FAT
+// block covers whole bitmap words, so slices never share a word.
+void *fat_scan(void *arg) {
+    struct fat_scan *scan = arg;
+    struct fs *fs = scan->fs;
+    size_t perBlock = fat_per_block(fs);
+    size_t dataBlocks = fs->super_block->data_block_amount;
+
+    scan->ret = cache_read_range(fs->cache, 1 + scan->first, scan->count, &fs->fat_entries[scan->first]);
+    if (scan->ret == -1) {
+        return NULL;
     }
 
-	// Look for an empty entry in RootEntryArray
-    int emptyEntry = -1;
-    for (int i = 0; i < MAX_ROOT_ENTRIES; i++) {
-        if (RootEntryArray[i].file_name[0] == '\0') { // Empty entry found
-            emptyEntry = i;
-            break;
+    for (size_t block = scan->first; block < scan->first + scan->count; block++) {
+        // Staged by the journal, newer than the cached copy
+        if (fs->journal) {
+            journal_read(fs->journal, 1 + block, &fs->fat_entries[block]);
         }
-    }
-
-    if (emptyEntry == -1) {
-        fprintf(stderr, "Error: Root directory is full.\n");
-        return -1;
-    }
 
-	// Create the file by initializing RootEntry
-    strcpy((char *)RootEntryArray[emptyEntry].file_name, filename);
-    RootEntryArray[emptyEntry].file_size = 0;
-    RootEntryArray[emptyEntry].first_data_block_index = FAT_EOC; // Indicating no data blocks are allocated yet
-
-    // Write updated RootEntryArray back to disk
-    if (block_write(super_block->root_block_index, RootEntryArray) == -1) {
-        fprintf(stderr, "Error: Unable to write RootEntryArray to disk.\n");
-        return -1;
+        size_t end = min((block + 1) * perBlock, dataBlocks);
+        for (size_t i = block * perBlock; i < end; i++) {
+            uint32_t value = fs->super_block->version != VERSION_FAT16 ? fs->fat_entries[block].entries32[i - block * perBlock]
+                                                                       : block_decode(fs, fs->fat_entries[block].entries[i - block * perBlock]);
+            if (value == 0) {
+                fs->free_bitmap[i / 64] |= 1ULL << (i % 64);
+                scan->free++;
+            } else if (value == FAT_EOC) {
+                scan->chains++;
+            } else if (value >= dataBlocks) {
+                scan->bad++;
+            }
+        }
+        __atomic_store_n(&fs->fat_loaded[block], 1, __ATOMIC_RELEASE);
     }
 
-    return 0;
+    return NULL;
 }
 
-int fs_delete(const char *filename)
-{
-    if (!is_mounted) {
-        fprintf(stderr, "Error: Filesystem is not mounted.\n");
-        return -1;
+// Load the whole FAT, split in slices read and checked by up to one thread per
+// core. Slices whose thread cannot be started are handled by the caller.
+int fat_scan_all(struct fs *fs) {
+    size_t blocks = fs->super_block->fat_block_amount;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = min((blocks + FAT_SCAN_MIN_BLOCKS - 1) / FAT_SCAN_MIN_BLOCKS, (size_t)FAT_SCAN_MAX_THREADS);
+    struct fat_scan scans[FAT_SCAN_MAX_THREADS];
+    pthread_t tids[FAT_SCAN_MAX_THREADS];
+    int started[FAT_SCAN_MAX_THREADS] = {0};
+
+    if (cores > 0 && (size_t)cores < threads) {
+        threads = cores;
     }
-
-    if (!is_valid_filename(filename)) {
-        fprintf(stderr, "Error: Filename is invalid or too long.\n");
-        return -1;
+    if (threads == 0) {
+        threads = 1;
     }
-    // Check if file exists
-    int fileIndex = -1;
-    for (int i = 0; i < MAX_ROOT_ENTRIES; i++) {
-        if (strcmp((char *)RootEntryArray[i].file_name, filename) == 0) {
-            fileIndex = i;
-            break;
+
+    for (size_t t = 0; t < threads; t++) {
+        scans[t] = (struct fat_scan){.fs = fs, .first = blocks * t / threads};
+        scans[t].count = blocks * (t + 1) / threads - scans[t].first;
+        if (t > 0) {
+            started[t] = pthread_create(&tids[t], NULL, fat_scan, &scans[t]) == 0;
         }
     }
-    if (fileIndex == -1) {
-        fprintf(stderr, "Error: File not found.\n");
-        return -1;
-    }
 
-    // Free allocated FAT entries
-    uint16_t currentBlock = RootEntryArray[fileIndex].first_data_block_index;
-    while (currentBlock != FAT_EOC) {
-        int fatBlockIndex = currentBlock / (BLOCK_SIZE / sizeof(uint16_t));
-        uint16_t nextBlockIndex = fat_entries[fatBlockIndex].entries[currentBlock % (BLOCK_SIZE / sizeof(uint16_t))];
-        fat_entries[fatBlockIndex].entries[currentBlock % (BLOCK_SIZE / sizeof(uint16_t))] = 0;  // Mark the block as free
-        
-        // Write the modified FAT block back to disk
-        // Assuming FAT starts immediately after the superblock, at block 1
-        int diskBlockNum = 1 + fatBlockIndex; // Add 1 to account for the superblock at block 0
-        if (block_write(diskBlockNum, &fat_entries[fatBlockIndex]) == -1) {
-            fprintf(stderr, "Error: Unable to write FAT block to disk.\n");
-            return -1;
+    fat_scan(&scans[0]);
+
+    size_t chains = 0, bad = 0;
+    int ret = 0;
+    fs->free_block_count = 0;
+    for (size_t t = 0; t < threads; t++) {
+        if (t > 0) {
+            if (started[t]) {
+                pthread_join(tids[t], NULL);
+            } else {
+                fat_scan(&scans[t]);
+            }
+        }
+        if (scans[t].ret == -1) {
+            fprintf(stderr, "Error: Unable to read FAT blocks %zu to %zu.\n", scans[t].first,
+                    scans[t].first + scans[t].count - 1);
+            ret = -1;
         }
+        fs->free_block_count += scans[t].free;
+        chains += scans[t].chains;
+        bad += scans[t].bad;
+    }
 
-        currentBlock = nextBlockIndex;
+    if (ret == 0 && bad) {
+        fprintf(stderr, "Warning: %zu FAT entries link outside the %" PRIu32 " data blocks (%zu chains, %zu free).\n",
+                bad, fs->super_block->data_block_amount, chains, fs->free_block_count);
     }
 
-    memset(&RootEntryArray[fileIndex], 0, sizeof(RootEntry));
+    return ret;
+}
+
+// Allocate the FAT and free block bitmap. With an up to date free block
+// summary, FAT blocks are left to be loaded on first use; otherwise the whole
+// FAT is read in parallel to count the free blocks.
+int build_free_bitmap(struct fs *fs) {
+    size_t words = (fs->super_block->data_block_amount + 63) / 64;
 
-    // Write the updated root directory back to disk
-    if (block_write(super_block->root_block_index, RootEntryArray) == -1) {
-        fprintf(stderr, "Error: Unable to write RootEntryArray to disk.\n");
+    fs->free_bitmap = calloc(words ? words : 1, sizeof(uint64_t));
+    if (!fs->free_bitmap) {
+        fprintf(stderr, "Error: unable to allocate memory for the free block bitmap.\n");
         return -1;
     }
+    fs->alloc_hint = 0;
 
-    return 0;
+    if (fs->super_block->clean) {
+        fs->free_block_count = fs->super_block->free_block_amount;
+        return 0;
+    }
+
+    return fat_scan_all(fs);
 }
 
-int fs_ls(void)
-{
-    if (!is_mounted()) {
-        fprintf(stderr, "Error: Filesystem is not mounted.\n");
-        return -1;
-    } 
+// FNV-1a hash of @name, which also picks its block in a subdirectory
+uint32_t name_hash32(const char *name) {
+    uint32_t hash = 2166136261u;
 
-    printf("FS Ls:\n");
+    for (int i = 0; i < MAX_FILENAME && name[i] != '\0'; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
 
-    // Iterate through the Root Directory
-    for (int i = 0; i < MAX_ROOT_ENTRIES; i++) {
-        // Check if the entry is valid (non-empty)
-        if (RootEntryArray[i].file_name[0] != '\0') {
-            printf("file: %s, size: %d, data_blk: %d\n",
-                   RootEntryArray[i].file_name,
-                   RootEntryArray[i].file_size,
-                   RootEntryArray[i].first_data_block_index);
+    return hash;
+}
+
+// Home slot of @name of directory @parent in the name index
+size_t name_hash(int parent, const char *name) {
+    return (name_hash32(name) ^ (uint32_t)parent * 2654435761u) & (NAME_INDEX_SIZE - 1);
+}
+
+// Table entry holding @filename in directory @parent, or -1
+int name_index_lookup(struct fs *fs, int parent, const char *filename) {
+    for (size_t slot = name_hash(parent, filename); fs->name_index[slot] != NAME_INDEX_EMPTY;
+         slot = (slot + 1) & (NAME_INDEX_SIZE - 1)) {
+        int entry = fs->name_index[slot];
+        if (fs->entry_links[entry].parent == parent &&
+            strncmp((char *)fs->RootEntryArray[entry].file_name, filename, MAX_FILENAME) == 0) {
+            return entry;
         }
     }
 
-    return 0;
+    return -1;
 }
 
-int fs_open(const char *filename)
-{
-    int fd = -1;
-    if (!is_mounted()) {
-        fprintf(stderr, "Error: Filesystem is not mounted.\n");
-        return -1;  // Filesystem not mounted
+void name_index_insert(struct fs *fs, int entry) {
+    size_t slot = name_hash(fs->entry_links[entry].parent, (char *)fs->RootEntryArray[entry].file_name);
+
+    while (fs->name_index[slot] != NAME_INDEX_EMPTY) {
+        slot = (slot + 1) & (NAME_INDEX_SIZE - 1);
     }
+    fs->name_index[slot] = entry;
+    fs->free_entries[entry / 64] &= ~(1ULL << (entry % 64));
+}
 
-    if (!is_valid_filename(filename)) {
-        fprintf(stderr, "Error: Filename is invalid or too long.\n");
-        return -1;
+// Must be called while the entry still holds its name
+void name_index_remove(struct fs *fs, int entry) {
+    size_t slot = name_hash(fs->entry_links[entry].parent, (char *)fs->RootEntryArray[entry].file_name);
+
+    while (fs->name_index[slot] != entry) {
+        slot = (slot + 1) & (NAME_INDEX_SIZE - 1);
     }
-    // Check if file exists
-    int fileIndex = -1;
-    for (int i = 0; i < MAX_ROOT_ENTRIES; i++) {
-        if (strcmp((char *)RootEntryArray[i].file_name, filename) == 0) {
-            fileIndex = i;
-            break;
+
+    // Shift back the following entries of the probe sequence, no tombstones
+    size_t hole = slot;
+    for (size_t next = (hole + 1) & (NAME_INDEX_SIZE - 1); fs->name_index[next] != NAME_INDEX_EMPTY;
+         next = (next + 1) & (NAME_INDEX_SIZE - 1)) {
+        size_t home = name_hash(fs->entry_links[fs->name_index[next]].parent, (char *)fs->RootEntryArray[fs->name_index[next]].file_name);
+        // Move it unless its home lies cyclically in (hole, next]
+        if (((next - home) & (NAME_INDEX_SIZE - 1)) >= ((next - hole) & (NAME_INDEX_SIZE - 1))) {
+            fs->name_index[hole] = fs->name_index[next];
+            hole = next;
         }
     }
-    // Check if file is found 
-    if (fileIndex == -1) {
-        fprintf(stderr, "Error: File not found.\n");
-        return -1;
-    }
+    fs->name_index[hole] = NAME_INDEX_EMPTY;
+    fs->free_entries[entry / 64] |= 1ULL << (entry % 64);
+}
 
-    // Look for spot in file descriptor table.
-    // Available spots set to NULL when mounting to establish an empty table.
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (fd_table[i] == NULL) {  // Found an available spot
-            fd_table[i] = malloc(sizeof(FileDescriptor));
-            if (fd_table[i] == NULL) {
-                fprintf(stderr, "Failed to allocate memory for FD.\n");
-                return -1;  // Failed to allocate memory for FD
-            }
-            fd_table[i]->offset = 0;  // Initialize file offset to 0
-            fd_table[i]->index = fileIndex;  // Store the index of the file in the root directory
-            fd_table[i]->in_use = 1;  // Mark FD as in use
-            fd = i;  // FD is the index in the fd_table
-            break;
+// Lowest free table entry in [@from, @to), both multiples of 64, or -1
+int first_free_entry(struct fs *fs, int from, int to) {
+    for (int w = from / 64; w < to / 64; w++) {
+        if (fs->free_entries[w] != 0) {
+            return w * 64 + __builtin_ctzll(fs->free_entries[w]);
         }
     }
 
-    if (fd == -1) {
-        fprintf(stderr, "Error: No available file descriptor spot.\n");
-        return -1;  // No available file descriptor spot
-    }
-    
-    return fd;  // Return the file descriptor
+    return -1;
 }
 
-int fs_close(int fd)
-{
-    // Check if the file descriptor is within the valid range
-    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
-        fprintf(stderr, "FD %d is not in valid range [0, %d).\n", fd, FS_OPEN_MAX_COUNT);
-        return -1; // Invalid file descriptor
+// Index every file of the root directory; no subdirectory entry is loaded yet
+void build_name_index(struct fs *fs) {
+    for (int i = 0; i < NAME_INDEX_SIZE; i++) {
+        fs->name_index[i] = NAME_INDEX_EMPTY;
     }
-
-    // Check if the file descriptor is actually in use
-    if (fd_table[fd] == NULL || fd_table[fd]->in_use == 0) {
-        fprintf(stderr, "File not in use\n");
-        return -1; // File descriptor not in use or invalid
+    for (int w = 0; w < TABLE_ENTRIES / 64; w++) {
+        fs->free_entries[w] = ~0ULL;
+    }
+    for (int i = 0; i < TABLE_ENTRIES; i++) {
+        fs->entry_links[i] = (EntryLink){ .parent = ROOT_DIR };
     }
 
-    // Free the allocated memory for the file descriptor
-    free(fd_table[fd]);
-    // Mark the slot as available again
-    fd_table[fd] = NULL;
-
-    return 0; // Successful closure
+    for (int i = 0; i < MAX_ROOT_ENTRIES; i++) {
+        if (fs->RootEntryArray[i].file_name[0] != '\0') {
+            name_index_insert(fs, i);
+        }
+    }
 }
 
-int is_valid_fd(int fd) {
-    return (fd >= 0 && fd < FS_OPEN_MAX_COUNT && fd_table[fd] != NULL && fd_table[fd]->in_use != 0);
-}
+// Fill super_block from the on-disk superblock, according to its version
+int load_super_block(struct fs *fs, const DiskSuperBlock *disk) {
+    fs->super_block->version = disk->version;
+
+    if (disk->version == VERSION_FAT16) {
+        fs->super_block->total_block_amount = disk->total_block_amount;
+        fs->super_block->root_block_index = disk->root_block_index;
+        fs->super_block->data_block_index = disk->data_block_index;
+        fs->super_block->data_block_amount = disk->data_block_amount;
+        fs->super_block->fat_block_amount = disk->fat_block_amount;
+        fs->super_block->journal_block_index = 0;
+        fs->super_block->journal_block_amount = 0;
+        fs->super_block->clean = 0;
+    } else if (disk->version == VERSION_FAT32 || disk->version == VERSION_EXTENTS) {
+        fs->super_block->total_block_amount = disk->total_block_amount32;
+        fs->super_block->root_block_index = disk->root_block_index32;
+        fs->super_block->data_block_index = disk->data_block_index32;
+        fs->super_block->data_block_amount = disk->data_block_amount32;
+        fs->super_block->fat_block_amount = disk->fat_block_amount32;
+        fs->super_block->journal_block_index = disk->journal_block_index32;
+        fs->super_block->journal_block_amount = disk->journal_block_amount32;
+        fs->super_block->free_block_amount = disk->free_block_amount32;
+        fs->super_block->clean = disk->clean == SUPERBLOCK_CLEAN &&
+                                 disk->free_block_amount32 < disk->data_block_amount32;
+    } else {
+        fprintf(stderr, "Error: unsupported file system version %d.\n", disk->version);
+        return -1;
+    }
 
-int fs_stat(int fd)
-{
-    if (!is_mounted()) {
-        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+    // The FAT must have an entry per data block, and an end of chain marker
+    // that no block can be mistaken for
+    size_t perBlock = disk->version != VERSION_FAT16 ? FAT32_ENTRIES_PER_BLOCK : FAT_ENTRIES_PER_BLOCK;
+    uint32_t maxBlocks = disk->version != VERSION_FAT16 ? FAT_EOC : FAT16_EOC;
+    if ((size_t)fs->super_block->fat_block_amount * perBlock < fs->super_block->data_block_amount ||
+        fs->super_block->data_block_amount >= maxBlocks) {
+        fprintf(stderr, "Error: FAT does not match the data block amount.\n");
         return -1;
     }
 
-    if (!is_valid_fd(fd)) {
-        fprintf(stderr, "Error: Invalid file descriptor.\n");
+    // The journal sits between the root directory and the data blocks
+    uint32_t journal = fs->super_block->journal_block_index;
+    if (fs->super_block->journal_block_amount &&
+        (fs->super_block->journal_block_amount < JOURNAL_MIN_BLOCKS || journal <= fs->super_block->root_block_index ||
+         journal + fs->super_block->journal_block_amount > fs->super_block->data_block_index)) {
+        fprintf(stderr, "Error: journal does not fit before the data blocks.\n");
         return -1;
     }
 
-    // Retrieve and return the size of the file associated with the file descriptor
-    return RootEntryArray[fd_table[fd]->index].file_size;
+    return 0;
 }
 
-int fs_lseek(int fd, size_t offset)
-{
-    if (!is_mounted()) {
-        fprintf(stderr, "Error: Filesystem is not mounted.\n");
-        return -1;
+// Record the free block count in the superblock, as up to date if @clean, and
+// make it durable. The 16-bit superblock of fs_make.x disks is left alone.
+int store_super_block(struct fs *fs, int clean) {
+    DiskSuperBlock disk;
+
+    if (fs->super_block->version == VERSION_FAT16) {
+        return 0;
     }
 
-    if (!is_valid_fd(fd)) {
-        fprintf(stderr, "Error: Invalid file descriptor.\n");
+    if (cache_read(fs->cache, 0, &disk) == -1) {
         return -1;
     }
+    disk.free_block_amount32 = fs->free_block_count + fs->freed_count;
+    disk.clean = clean ? SUPERBLOCK_CLEAN : 0;
 
-    // Get the size of the file associated with the file descriptor
-    size_t fileSize = RootEntryArray[fd_table[fd]->index].file_size;
-
-    // Validate the offset
-    if (offset > fileSize) {
-        fprintf(stderr, "Error: Offset is larger than the file size.\n");
+    if (cache_write_kind(fs->cache, 0, &disk, CACHE_ALLOC) == -1 ||
+        cache_sync_kind(fs->cache, CACHE_ALLOC) == -1 ||
+        block_disk_sync_h(fs->disk) == -1) {
+        fprintf(stderr, "Error: Unable to write the superblock to disk.\n");
         return -1;
     }
 
-    fd_table[fd]->offset = offset;
-
-    return 0; 
+    fs->super_block->clean = clean;
+    return 0;
 }
 
-
-
-
-int fs_read(int fd, void *buf, size_t count) {
-    if (!is_mounted() || fd < 0 || fd >= FS_OPEN_MAX_COUNT || buf == NULL || fd_table[fd] == NULL) {
-        fprintf(stderr, "Error: failed intial check read.\n");
-        return -1; // Check for mounted FS, valid FD, and non-null buffer
+// Decode entry @slot of directory block @block into @entry
+void entry_decode(struct fs *fs, const uint8_t *block, int slot, RootEntry *entry) {
+    if (fs->super_block->version != VERSION_FAT16) {
+        const RootEntry32 *disk = (const RootEntry32 *)block + slot;
+        memcpy(entry->file_name, disk->file_name, MAX_FILENAME);
+        entry->file_size = disk->file_size;
+        entry->first_data_block_index = disk->first_data_block_index;
+        entry->type = disk->type;
+    } else {
+        const RootEntry16 *disk = (const RootEntry16 *)block + slot;
+        memcpy(entry->file_name, disk->file_name, MAX_FILENAME);
+        entry->file_size = disk->file_size;
+        entry->first_data_block_index = block_decode(fs, disk->first_data_block_index);
+        entry->type = disk->type;
     }
+}
 
-    FileDescriptor *fileDesc = fd_table[fd];
-    uint16_t currentBlock = RootEntryArray[fileDesc->index].first_data_block_index;
-    size_t fileOffset = fileDesc->offset;
-    size_t bytesToRead = min(count, RootEntryArray[fileDesc->index].file_size - fileOffset);
-    size_t bytesRead = 0;
+// Encode @entry into slot @slot of directory block @block
+void entry_encode(struct fs *fs, uint8_t *block, int slot, const RootEntry *entry) {
+    memset(block + slot * ENTRY_SIZE, 0, ENTRY_SIZE);
+    if (fs->super_block->version != VERSION_FAT16) {
+        RootEntry32 *disk = (RootEntry32 *)block + slot;
+        memcpy(disk->file_name, entry->file_name, MAX_FILENAME);
+        disk->file_size = entry->file_size;
+        disk->first_data_block_index = entry->first_data_block_index;
+        disk->type = entry->type;
+    } else {
+        RootEntry16 *disk = (RootEntry16 *)block + slot;
+        memcpy(disk->file_name, entry->file_name, MAX_FILENAME);
+        disk->file_size = entry->file_size;
+        disk->first_data_block_index = block_encode(fs, entry->first_data_block_index);
+        disk->type = entry->type;
+    }
+}
 
-    char *bounceBuffer = malloc(BLOCK_SIZE); // Using a bounce buffer for each block read
-    if (!bounceBuffer) {
-        fprintf(stderr, "Error: Failed to allocate bounce buffer.\n");
-        return -1; // Failed to allocate bounce buffer
+// Read metadata block @block, staged in the journal or through the cache
+int meta_read(struct fs *fs, size_t block, void *buf) {
+    if (fs->journal && journal_read(fs->journal, block, buf)) {
+        return 0;
     }
 
-    while (bytesToRead > 0 && currentBlock != FAT_EOC) {
-        int blockIndex = super_block->data_block_index + currentBlock; // Calculate actual block index
-        block_read(blockIndex, bounceBuffer);
+    return cache_read(fs->cache, block, buf);
+}
 
-        size_t blockOffset = fileOffset % BLOCK_SIZE;
-        size_t bytesInBlock = min(BLOCK_SIZE - blockOffset, bytesToRead);
-        
-        memcpy(buf + bytesRead, bounceBuffer + blockOffset, bytesInBlock);
+// Write metadata block @block, through the journal when the disk has one, so
+// that it only reaches its home location once logged
+int meta_write(struct fs *fs, size_t block, const void *buf, enum cache_kind kind) {
+    if (fs->journal) {
+        return journal_write(fs->journal, block, buf, kind);
+    }
 
-        bytesRead += bytesInBlock;
-        bytesToRead -= bytesInBlock;
-        fileOffset += bytesInBlock;
+    return cache_write_kind(fs->cache, block, buf, kind);
+}
 
-        if (bytesInBlock < BLOCK_SIZE - blockOffset || currentBlock == FAT_EOC) {
-            break; // Either we've read the requested bytes or reached the end of file
-        }
+// Read the root directory block into the first MAX_ROOT_ENTRIES table entries
+int load_root(struct fs *fs) {
+    uint8_t block[BLOCK_SIZE];
 
-        currentBlock = fat_entries[currentBlock].entries[0]; // Move to next block in the chain
+    if (cache_read(fs->cache, fs->super_block->root_block_index, block) == -1) {
+        return -1;
     }
 
-    fileDesc->offset += bytesRead; // Update the file descriptor's offset
-
-    free(bounceBuffer); // Free the allocated bounce buffer
+    for (int i = 0; i < MAX_ROOT_ENTRIES; i++) {
+        entry_decode(fs, block, i, &fs->RootEntryArray[i]);
+    }
 
-    return bytesRead; // Return the number of bytes read
+    return 0;
 }
 
-uint16_t allocate_block() {
-    // Iterate through the FAT to find a free block
-    for (uint16_t i = 1; i < super_block->data_block_amount; ++i) {  // Start from 1 since 0 is reserved
-        uint16_t fatBlock = i / (BLOCK_SIZE / sizeof(uint16_t)); // Which FAT block the entry is in
-        uint16_t entryIndex = i % (BLOCK_SIZE / sizeof(uint16_t)); // Entry index within the FAT block
+// Write the root entries back to the root directory block
+int store_root(struct fs *fs) {
+    uint8_t block[BLOCK_SIZE] = {0};
+
+    for (int i = 0; i < MAX_ROOT_ENTRIES; i++) {
+        entry_encode(fs, block, i, &fs->RootEntryArray[i]);
+    }
 
-        if (fat_entries[fatBlock].entries[entryIndex] == 0) {  // If the entry is free
-            fat_entries[fatBlock].entries[entryIndex] = FAT_EOC;  // Mark it as the end of a chain
+    return meta_write(fs, fs->super_block->root_block_index, block, CACHE_DIR);
+}
 
-            // Write the updated FAT block back to disk
-            if (block_write(super_block->data_block_index + fatBlock, &fat_entries[fatBlock]) == -1) {
-                fprintf(stderr, "Failed to write FAT block to disk\n");
-                return FAT_EOC;  // Return an error if writing the FAT block fails
-            }
+// Close the cache and disk of @fs, mounted or not, and free it
+int fs_release(struct fs *fs) {
+    int ret = 0;
 
-            // Return the actual block number, considering the data block start index
-            return super_block->data_block_index + i;
+    // Read-ahead still in flight lands in the cache
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fs->fd_table[i] && fs->fd_table[i]->queue) {
+            block_queue_close(fs->fd_table[i]->queue);
+            fs->fd_table[i]->queue = NULL;
         }
     }
-    // If no free block is found, return FAT_EOC to indicate failure
-    return FAT_EOC;
-}
 
+    // Committed metadata goes home, and the log is emptied
+    if (fs->journal && journal_close(fs->journal) == -1) {
+        ret = -1;
+    }
 
+    // Write back every dirty cached block before the disk goes away
+    if (fs->cache && cache_close(fs->cache) == -1) {
+        ret = -1;
+    }
 
-int fs_write(int fd, void *buf, size_t count) {
-    if (!super_block || !fat_entries || !RootEntryArray || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd] == NULL || buf == NULL) {
-        fprintf(stderr, "Error: failed write intial state.\n");
+	// Free dynamically allocated memory
+    free_memory(fs);
 
-        return -1;
+    // Close virtual disk
+    if (fs->disk && block_disk_close_h(fs->disk) == -1) {
+        fprintf(stderr, "Error: Unable to close virtual disk.\n");
+        ret = -1;
     }
 
-    size_t bytesWritten = 0; 
-    uint16_t currentBlock = RootEntryArray[fd_table[fd]->index].first_data_block_index;
-    uint16_t previousBlock = FAT_EOC;
-    size_t fileOffset = fd_table[fd]->offset;
-    size_t remaining = count;
+    pthread_rwlock_destroy(&fs->dir_lock);
+    pthread_rwlock_destroy(&fs->fat_lock);
+    pthread_mutex_destroy(&fs->fat_load_lock);
+    for (int i = 0; i < TABLE_ENTRIES; i++) {
+        pthread_mutex_destroy(&fs->file_locks[i]);
+    }
+    free(fs);
 
-    while (remaining > 0) {
-        if (currentBlock == FAT_EOC) {
-            // Allocate a new block and update FAT as necessary
-            currentBlock = allocate_block(); 
-            if (currentBlock == FAT_EOC) {
-                break; // No more space available
-            }
-            if (previousBlock != FAT_EOC) {
-                fat_entries[previousBlock].entries[0] = currentBlock;
-            } else {
-                RootEntryArray[fd_table[fd]->index].first_data_block_index = currentBlock;
-            }
-        }
+    return ret;
+}
 
-        char blockBuffer[BLOCK_SIZE];
-        if (block_read(super_block->data_block_index + currentBlock, blockBuffer) == -1) {
-            fprintf(stderr, "Error reading block\n");
-            break; // Error reading block
+fs_t *fs_mount_h(const char *diskname)
+{
+	return fs_mount_opts_h(diskname, NULL);
+}
+
+fs_t *fs_mount_opts_h(const char *diskname, const struct fs_mount_opts *opts)
+{
+	size_t cacheBlocks = opts ? opts->cache_blocks : CACHE_DEFAULT_BLOCKS;
+	enum block_backend backend = BLOCK_BACKEND_PREAD;
+
+	// A mapped disk is cached by the kernel, a second copy would only cost memory
+	if (opts && opts->backend == FS_BACKEND_MMAP) {
+		backend = BLOCK_BACKEND_MMAP;
+		cacheBlocks = 0;
+	}
+
+	struct fs *fs = calloc(1, sizeof(struct fs));
+	if (!fs) {
+        fprintf(stderr, "Error: unable to allocate the file system.\n");
+        return NULL;
+	}
+	pthread_rwlock_init(&fs->dir_lock, NULL);
+	pthread_rwlock_init(&fs->fat_lock, NULL);
+	pthread_mutex_init(&fs->fat_load_lock, NULL);
+	for (int i = 0; i < TABLE_ENTRIES; i++) {
+		pthread_mutex_init(&fs->file_locks[i], NULL);
+	}
+
+	// Open virtual disk
+	fs->disk = block_disk_open_h(diskname, backend);
+	if (!fs->disk) {
+		fs_release(fs);
+		return NULL;
+	}
+	// Every block access below goes through the block cache
+	fs->cache = cache_open(fs->disk, cacheBlocks);
+	if (!fs->cache) {
+		fs_release(fs);
+		return NULL;
+	}
+	// Read super_block at beginning of virtual disk
+	DiskSuperBlock diskSuperBlock;
+	fs->super_block = malloc(sizeof(SuperBlock));
+	if (!fs->super_block || cache_read(fs->cache, 0, &diskSuperBlock) == -1) {
+        fprintf(stderr, "Error: unable to read the superblock from disk.\n");
+        fs_release(fs);
+        return NULL;
+    }
+	// Verify signature has correct signature
+	if (memcmp(diskSuperBlock.signature, SIGNATURE, SIGNATURE_LENGTH) != 0) {
+		fprintf(stderr, "Error: disk signature doesn't match.\n");
+        fs_release(fs);
+        return NULL;
+	}
+
+	if (load_super_block(fs, &diskSuperBlock) == -1) {
+        fs_release(fs);
+        return NULL;
+	}
+
+	// Verify super_block has correct block amount
+	if (fs->super_block->total_block_amount != (uint32_t)block_disk_count_h(fs->disk)) {
+		fprintf(stderr, "Error: super_block has wrong block amount.\n");
+        fs_release(fs);
+		return NULL;
+	}
+
+	// Replay the metadata journal, which may hold a newer superblock
+	if (fs->super_block->journal_block_amount) {
+		fs->journal = journal_open(fs->cache, fs->disk, fs->super_block->journal_block_index,
+		                           fs->super_block->journal_block_amount);
+		if (!fs->journal || cache_read(fs->cache, 0, &diskSuperBlock) == -1 ||
+		    load_super_block(fs, &diskSuperBlock) == -1) {
+			fprintf(stderr, "Error: unable to recover the file system from its journal.\n");
+			fs_release(fs);
+			return NULL;
+		}
+	}
+
+	// FAT array, filled as its blocks are loaded
+	fs->fat_entries = malloc(sizeof(FAT) * fs->super_block->fat_block_amount);
+	fs->fat_dirty = calloc(fs->super_block->fat_block_amount, sizeof(uint8_t));
+	fs->fat_loaded = calloc(fs->super_block->fat_block_amount, sizeof(uint8_t));
+	if (!fs->fat_entries || !fs->fat_dirty || !fs->fat_loaded) {
+        fprintf(stderr, "Error: unable to allocate memory for the FAT.\n");
+        fs_release(fs);
+        return NULL;
+    }
+
+	if (build_free_bitmap(fs) == -1) {
+        fs_release(fs);
+        return NULL;
+	}
+
+	// The summary goes stale with the first change, until fs_umount()
+	if (fs->super_block->clean && store_super_block(fs, 0) == -1) {
+        fs_release(fs);
+        return NULL;
+	}
+
+	// Allocate memory for the root directory entries
+    fs->RootEntryArray = calloc(TABLE_ENTRIES, sizeof(RootEntry));
+    if (fs->RootEntryArray == NULL) {
+        fs_release(fs);
+        return NULL;
+    }	
+
+	// Read the root directory block from disk
+    if (load_root(fs) == -1) {
+        fs_release(fs);
+        return NULL;
+    }
+
+    build_name_index(fs);
+
+    // Initialize the file descriptor table
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        fs->fd_table[i] = NULL; // Set each file descriptor to NULL, indicating it's not in use
+    }
+
+	return fs;
+}
+
+// Write back every modified FAT block, once each, then the root directory
+int flush_metadata(struct fs *fs) {
+    int ret = 0;
+
+    for (int i = 0; i < TABLE_ENTRIES; i++) {
+        ExtentList *list = fs->extent_lists[i];
+        if (!list || !list->dirty || fs->RootEntryArray[i].first_data_block_index == FAT_EOC) {
+            continue;
+        }
+        if (meta_write(fs, fs->super_block->data_block_index + fs->RootEntryArray[i].first_data_block_index, &list->block, CACHE_ALLOC) == -1) {
+            fprintf(stderr, "Error: Unable to write extent block to disk.\n");
+            ret = -1;
+            continue;
+        }
+        list->dirty = 0;
+    }
+
+    // Changed subdirectory entries, into their directory's blocks
+    for (int i = MAX_ROOT_ENTRIES; i < TABLE_ENTRIES; i++) {
+        if (!fs->entry_links[i].dirty) {
+            continue;
+        }
+        if (dir_store(fs, fs->entry_links[i].parent, &fs->RootEntryArray[i], 0) == -1) {
+            fprintf(stderr, "Error: Unable to write directory entry to disk.\n");
+            ret = -1;
+            continue;
+        }
+        fs->entry_links[i].dirty = 0;
+    }
+
+    for (size_t i = 0; i < fs->super_block->fat_block_amount; i++) {
+        if (!fs->fat_dirty[i]) {
+            continue;
+        }
+        // FAT starts immediately after the superblock, at block 1
+        if (meta_write(fs, 1 + i, &fs->fat_entries[i], CACHE_ALLOC) == -1) {
+            fprintf(stderr, "Error: Unable to write FAT block to disk.\n");
+            ret = -1;
+            continue;
+        }
+        fs->fat_dirty[i] = 0;
+    }
+
+    if (fs->root_dirty) {
+        if (store_root(fs) == -1) {
+            fprintf(stderr, "Error: Unable to write RootEntryArray to disk.\n");
+            ret = -1;
+        } else {
+            fs->root_dirty = 0;
+        }
+    }
+
+    return ret;
+}
+
+// Pass the writes buffered in the bounce buffer of @fileDesc to the cache.
+// With @forget, the bounce buffer no longer stands for the block afterwards.
+int write_behind_flush(struct fs *fs, FileDescriptor *fileDesc, int forget) {
+    if (fileDesc->wb_block != FAT_EOC && fileDesc->wb_dirty) {
+        if (cache_write(fs->cache, fileDesc->wb_block, fileDesc->bounce) == -1) {
+            fprintf(stderr, "Error: Unable to write back buffered writes.\n");
+            return -1;
+        }
+        fileDesc->wb_dirty = 0;
+    }
+
+    if (forget) {
+        fileDesc->wb_block = FAT_EOC;
+    }
+    return 0;
+}
+
+// Flush and forget the blocks buffered by the descriptors open on table entry
+// @index, other than @self, so that the cache holds the file's latest data
+int write_behind_flush_file(struct fs *fs, int index, FileDescriptor *self) {
+    int ret = 0;
+
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        FileDescriptor *other = fs->fd_table[i];
+        if (other && other != self && other->index == index && write_behind_flush(fs, other, 1) == -1) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+// Table entries of the open files, in ascending order and once each. The
+// directory lock must be held so that no descriptor is opened or closed.
+int open_files(struct fs *fs, int *files) {
+    int count = 0;
+
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (!fs->fd_table[i]) {
+            continue;
+        }
+        int index = fs->fd_table[i]->index, j = count;
+        while (j > 0 && files[j - 1] > index) {
+            j--;
+        }
+        if (j > 0 && files[j - 1] == index) {
+            continue;
+        }
+        memmove(&files[j + 1], &files[j], (count - j) * sizeof(int));
+        files[j] = index;
+        count++;
+    }
+
+    return count;
+}
+
+// Stop every change to the file system: no file can be opened, closed,
+// created or deleted, and no open file written, until sync_unlock()
+int sync_lock(struct fs *fs, int *files) {
+    pthread_rwlock_rdlock(&fs->dir_lock);
+    int count = open_files(fs, files);
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_lock(&fs->file_locks[files[i]]);
+    }
+    pthread_rwlock_wrlock(&fs->fat_lock);
+    return count;
+}
+
+void sync_unlock(struct fs *fs, const int *files, int count) {
+    pthread_rwlock_unlock(&fs->fat_lock);
+    for (int i = count - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&fs->file_locks[files[i]]);
+    }
+    pthread_rwlock_unlock(&fs->dir_lock);
+}
+
+// Pass everything written so far to the cache: the blocks buffered by the
+// descriptors, then the metadata referring to them
+int flush_all(struct fs *fs) {
+    int ret = 0;
+
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fs->fd_table[i] && write_behind_flush(fs, fs->fd_table[i], 0) == -1) {
+            ret = -1;
+        }
+    }
+    if (flush_metadata(fs) == -1) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+// Commit everything written so far to the journal, after flush_all(). The
+// blocks freed meanwhile can then be reused.
+int commit_all(struct fs *fs) {
+    int ret = flush_all(fs);
+
+    if (journal_commit(fs->journal) == -1) {
+        fprintf(stderr, "Error: Unable to commit the journal.\n");
+        return -1;
+    }
+    freed_release(fs);
+    return ret;
+}
+
+// Make everything written so far durable, under sync_lock(). Blocks go out in
+// the order they refer to each other: file data, then the FAT and extent
+// lists pointing at it, then the directories pointing at those, with a disk
+// flush between stages, so that a crash never leaves metadata on disk that
+// refers to blocks which did not make it. With a journal, the metadata is
+// appended to the log as one transaction instead, and written home later.
+int sync_ordered(struct fs *fs) {
+    static const enum cache_kind stages[] = { CACHE_ALLOC, CACHE_DIR };
+
+    if (fs->journal) {
+        return commit_all(fs);
+    }
+
+    int ret = flush_all(fs);
+
+    if (cache_sync_kind(fs->cache, CACHE_DATA) == -1) {
+        ret = -1;
+    }
+    for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+        // Whole-block writes bypass the cache, so the barrier is kept even
+        // when the previous stage had nothing dirty
+        if (!cache_dirty(fs->cache, stages[i])) {
+            continue;
+        }
+        if (block_disk_sync_h(fs->disk) == -1 ||
+            cache_sync_kind(fs->cache, stages[i]) == -1) {
+            ret = -1;
+        }
+    }
+
+    if (ret == -1) {
+        fprintf(stderr, "Error: Unable to flush the block cache.\n");
+        return -1;
+    }
+
+    if (block_disk_sync_h(fs->disk) == -1) {
+        fprintf(stderr, "Error: Unable to flush the virtual disk.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int is_mounted(struct fs *fs) {
+    return (fs != NULL && fs->super_block != NULL && fs->fat_entries != NULL && fs->RootEntryArray != NULL);
+}
+
+int fs_umount_h(fs_t *fs)
+{
+	if (!is_mounted(fs)) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;
+    }
+
+	// Make buffered writes and pending metadata durable, then the free block
+	// summary that lets the next fs_mount() skip reading the FAT, then release
+	// everything
+	int files[FS_OPEN_MAX_COUNT];
+	int count = sync_lock(fs, files);
+	int synced = sync_ordered(fs);
+	if (synced == 0) {
+		synced = store_super_block(fs, 1);
+	}
+	sync_unlock(fs, files, count);
+	if (fs_release(fs) == -1) {
+		synced = -1;
+	}
+
+	return synced;
+}
+
+int fs_sync_h(fs_t *fs)
+{
+	if (!is_mounted(fs)) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;
+    }
+
+    int files[FS_OPEN_MAX_COUNT];
+    int count = sync_lock(fs, files);
+    int synced = sync_ordered(fs);
+    sync_unlock(fs, files, count);
+
+	return synced;
+}
+
+// Metadata blocks are shared by every file, so the FAT and directory entries
+// of one file cannot reach the disk before the data of the others: syncing
+// one descriptor syncs the whole file system, in the same order as fs_sync().
+int fs_fsync_h(fs_t *fs, int fd)
+{
+	if (!is_mounted(fs)) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;
+    }
+
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
+        fprintf(stderr, "FD %d is not in valid range [0, %d).\n", fd, FS_OPEN_MAX_COUNT);
+        return -1;
+    }
+
+    int files[FS_OPEN_MAX_COUNT];
+    int count = sync_lock(fs, files);
+    if (fs->fd_table[fd] == NULL) {
+        sync_unlock(fs, files, count);
+        fprintf(stderr, "File not in use\n");
+        return -1;
+    }
+    int synced = sync_ordered(fs);
+    sync_unlock(fs, files, count);
+
+	return synced;
+}
+
+int fs_info_h(fs_t *fs)
+{
+	if (!is_mounted(fs)) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;
+    }
+
+    printf("FS Info:\n");
+    printf("total_blk_count=%" PRIu32 "\n", fs->super_block->total_block_amount);
+    printf("fat_blk_count=%" PRIu32 "\n", fs->super_block->fat_block_amount);
+    printf("rdir_blk=%" PRIu32 "\n", fs->super_block->root_block_index);
+    printf("data_blk=%" PRIu32 "\n", fs->super_block->data_block_index);
+    printf("data_blk_count=%" PRIu32 "\n", fs->super_block->data_block_amount);
+    if (fs->journal) {
+        printf("journal_blk=%" PRIu32 "\n", fs->super_block->journal_block_index);
+        printf("journal_blk_count=%" PRIu32 "\n", fs->super_block->journal_block_amount);
+    }
+
+    pthread_rwlock_rdlock(&fs->dir_lock);
+    pthread_rwlock_rdlock(&fs->fat_lock);
+
+    // Free blocks are tracked by the free block bitmap
+    size_t free_fat_blocks = fs->free_block_count + fs->freed_count;
+
+    // Count free root directory entries
+    int free_root_entries = 0;
+    for (int w = 0; w < MAX_ROOT_ENTRIES / 64; w++) {
+        free_root_entries += __builtin_popcountll(fs->free_entries[w]);
+    }
+
+    pthread_rwlock_unlock(&fs->fat_lock);
+    pthread_rwlock_unlock(&fs->dir_lock);
+
+    // Print the ratios of free FAT blocks to total data blocks, and free root directory entries to maximum root entries
+    printf("fat_free_ratio=%zu/%" PRIu32 "\n", free_fat_blocks, fs->super_block->data_block_amount);
+    printf("rdir_free_ratio=%d/%d\n", free_root_entries, MAX_ROOT_ENTRIES);
+
+	return 0;
+}
+
+// Hold back freed block @index until the journal commits, see freed_release()
+int freed_add(struct fs *fs, uint32_t index) {
+    if (fs->freed_count == fs->freed_size) {
+        size_t size = fs->freed_size ? 2 * fs->freed_size : 64;
+        uint32_t *freed = realloc(fs->freed, size * sizeof(uint32_t));
+        if (!freed) {
+            return -1;
+        }
+        fs->freed = freed;
+        fs->freed_size = size;
+    }
+
+    fs->freed[fs->freed_count++] = index;
+    return 0;
+}
+
+// Make the blocks held back by freed_add() available again, once the journal
+// holds their release
+void freed_release(struct fs *fs) {
+    for (size_t i = 0; i < fs->freed_count; i++) {
+        fs->free_bitmap[fs->freed[i] / 64] |= 1ULL << (fs->freed[i] % 64);
+    }
+    fs->free_block_count += fs->freed_count;
+    fs->freed_count = 0;
+}
+
+// Most FAT blocks that allocating or freeing @blocks data blocks changes: the
+// ones holding their entries, and the one linking them to a chain
+size_t fat_credits(struct fs *fs, size_t blocks) {
+    return min(blocks + 1, (size_t)fs->super_block->fat_block_amount);
+}
+
+// Let an operation that allocates up to @blocks data blocks and stages up to
+// @credits metadata blocks and revokes in the journal go ahead, with the
+// allocator held. Returns OP_RETRY if the running transaction must commit
+// first, so that the operation never straddles two transactions: when it has
+// no room left, or when the operation needs the blocks held back by
+// freed_add(), as reusing them before the commit would let a replay hand
+// their new content back to the file that freed them. The caller then drops
+// its locks and calls op_commit(). Returns -1 if the operation can never fit.
+int op_reserve(struct fs *fs, size_t blocks, size_t credits) {
+    if (!fs->journal) {
+        return 0;
+    }
+    if (fs->freed_count > 0 && fs->free_block_count < blocks) {
+        return OP_RETRY;
+    }
+
+    int ret = journal_reserve(fs->journal, credits);
+    if (ret == -1) {
+        fprintf(stderr, "Error: Operation too large for the journal.\n");
+    }
+    return ret == 1 ? OP_RETRY : ret;
+}
+
+// End an operation op_reserve() let go ahead, its changes now staged but for
+// those @credits fewer than it reserved cover
+void op_end(struct fs *fs, size_t credits) {
+    if (fs->journal) {
+        journal_release(fs->journal, credits);
+    }
+}
+
+// Commit the running transaction for an operation turned back by
+// op_reserve(), which holds no lock meanwhile
+int op_commit(struct fs *fs) {
+    int files[FS_OPEN_MAX_COUNT];
+    int count = sync_lock(fs, files);
+    int ret = sync_ordered(fs);
+    sync_unlock(fs, files, count);
+    return ret;
+}
+
+// Update FAT entry @index in memory; its FAT block is written back by
+// flush_metadata()
+void fat_set(struct fs *fs, uint32_t index, uint32_t value) {
+    int wide = fs->super_block->version != VERSION_FAT16;
+    size_t fatBlockIndex = index / (wide ? FAT32_ENTRIES_PER_BLOCK : FAT_ENTRIES_PER_BLOCK);
+
+    // Never write back a FAT block that could not be read
+    if (fat_load(fs, fatBlockIndex) == -1) {
+        return;
+    }
+
+    // Keep the free block bitmap in step with the FAT
+    if ((fat_get(fs, index) == 0) != (value == 0)) {
+        // A freed directory or extent block must not be replayed over its
+        // next content
+        if (value == 0 && fs->journal) {
+            journal_forget(fs->journal, fs->super_block->data_block_index + index);
+        }
+        if (value != 0 || !fs->journal || freed_add(fs, index) == -1) {
+            fs->free_bitmap[index / 64] ^= 1ULL << (index % 64);
+            fs->free_block_count += value == 0 ? 1 : -1;
+        }
+    }
+
+    if (wide) {
+        fs->fat_entries[fatBlockIndex].entries32[index % FAT32_ENTRIES_PER_BLOCK] = value;
+    } else {
+        fs->fat_entries[fatBlockIndex].entries[index % FAT_ENTRIES_PER_BLOCK] = block_encode(fs, value);
+    }
+    fs->fat_dirty[fatBlockIndex] = 1;
+}
+
+// Free every block of the chain starting at @block
+void free_chain(struct fs *fs, uint32_t block) {
+    while (block != FAT_EOC) {
+        uint32_t next = fat_get(fs, block);
+
+        // Mark the block as free
+        fat_set(fs, block, 0);
+
+        block = next;
+    }
+}
+
+// Free the @length blocks starting at data block @start
+void free_run(struct fs *fs, uint32_t start, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        fat_set(fs, start + i, 0);
+    }
+}
+
+// Length of the physically contiguous run starting at data block @first,
+// capped at @maxLength blocks
+size_t contiguous_run(struct fs *fs, uint32_t first, size_t maxLength) {
+    size_t runLength = 1;
+
+    while (runLength < maxLength && fat_get(fs, first + runLength - 1) == first + runLength) {
+        runLength++;
+    }
+
+    return runLength;
+}
+
+// Forget the chain map of table entry @index; called whenever its chain grows
+// or is freed
+void chain_map_drop(struct fs *fs, int index) {
+    free(fs->chain_maps[index].blocks);
+    fs->chain_maps[index].blocks = NULL;
+    fs->chain_maps[index].length = 0;
+}
+
+// Build the chain map of table entry @index from the FAT. Left unbuilt for an
+// empty file, or if the table cannot be allocated.
+void chain_map_build(struct fs *fs, int index) {
+    ChainMap *map = &fs->chain_maps[index];
+    uint32_t first = fs->RootEntryArray[index].first_data_block_index;
+    size_t length = 0;
+
+    for (uint32_t block = first; block != FAT_EOC; block = fat_get(fs, block)) {
+        length++;
+    }
+    if (length == 0 || (map->blocks = malloc(length * sizeof(uint32_t))) == NULL) {
+        return;
+    }
+
+    map->length = 0;
+    for (uint32_t block = first; block != FAT_EOC; block = fat_get(fs, block)) {
+        map->blocks[map->length++] = block;
+    }
+}
+
+// Physical block holding logical block @logical of the file open as
+// @fileDesc, and leaves the descriptor's cursor on it. Sequential access walks
+// the chain from the cursor; any other access goes through the file's chain
+// map, built on demand. Returns FAT_EOC past the end of the chain, with @last
+// (if not NULL) set to the chain's last block, or to FAT_EOC for an empty file.
+uint32_t cursor_seek(struct fs *fs, FileDescriptor *fileDesc, size_t logical, uint32_t *last) {
+    ChainMap *map = &fs->chain_maps[fileDesc->index];
+    size_t position = 0;
+    uint32_t block = fs->RootEntryArray[fileDesc->index].first_data_block_index;
+    uint32_t previous = FAT_EOC;
+    int atCursor = fileDesc->cursor_block != FAT_EOC && fileDesc->cursor_logical <= logical;
+
+    // Random access: would have to restart from the head, or jump far ahead
+    if (!map->blocks && logical > 0 && (!atCursor || logical - fileDesc->cursor_logical > 1)) {
+        chain_map_build(fs, fileDesc->index);
+    }
+
+    if (map->blocks) {
+        if (logical >= map->length) {
+            if (last) {
+                *last = map->blocks[map->length - 1];
+            }
+            return FAT_EOC;
+        }
+        fileDesc->cursor_logical = logical;
+        fileDesc->cursor_block = map->blocks[logical];
+        return fileDesc->cursor_block;
+    }
+
+    if (atCursor) {
+        position = fileDesc->cursor_logical;
+        block = fileDesc->cursor_block;
+    }
+
+    while (position < logical && block != FAT_EOC) {
+        previous = block;
+        block = fat_get(fs, block);
+        position++;
+    }
+
+    if (block != FAT_EOC) {
+        fileDesc->cursor_logical = position;
+        fileDesc->cursor_block = block;
+    } else if (last) {
+        *last = previous;
+    }
+
+    return block;
+}
+
+// Forget the cursors of every descriptor open on table entry @index, once its
+// chain has been freed
+void cursor_reset(struct fs *fs, int index) {
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fs->fd_table[i] && fs->fd_table[i]->index == index) {
+            fs->fd_table[i]->cursor_block = FAT_EOC;
+            fs->fd_table[i]->ra_block = FAT_EOC;
+        }
+    }
+}
+
+int uses_extents(struct fs *fs) {
+    return fs->super_block->version == VERSION_EXTENTS;
+}
+
+// Extent list of table entry @index, read from its extent block on first use.
+// Returns NULL if it cannot be loaded.
+ExtentList *extents_get(struct fs *fs, int index) {
+    ExtentList *list = fs->extent_lists[index];
+    uint32_t extentBlock = fs->RootEntryArray[index].first_data_block_index;
+
+    if (list) {
+        return list;
+    }
+
+    list = calloc(1, sizeof(ExtentList));
+    if (!list) {
+        return NULL;
+    }
+    if (extentBlock != FAT_EOC) {
+        if (meta_read(fs, fs->super_block->data_block_index + extentBlock, &list->block) == -1) {
+            free(list);
+            return NULL;
+        }
+        if (list->block.count > EXTENTS_PER_BLOCK) {
+            fprintf(stderr, "Error: corrupted extent block %" PRIu32 ".\n", extentBlock);
+            free(list);
+            return NULL;
+        }
+    }
+
+    for (uint32_t i = 0; i < list->block.count; i++) {
+        list->logical[i + 1] = list->logical[i] + list->block.extents[i].length;
+    }
+
+    fs->extent_lists[index] = list;
+    return list;
+}
+
+// Last data block of an extent list, or FAT_EOC if it is empty
+uint32_t extents_last(const ExtentList *list) {
+    if (!list || list->block.count == 0) {
+        return FAT_EOC;
+    }
+
+    const Extent *extent = &list->block.extents[list->block.count - 1];
+    return extent->start + extent->length - 1;
+}
+
+// Last extent of a non-empty list starting at or before logical block @logical
+uint32_t extents_find(const ExtentList *list, size_t logical) {
+    uint32_t low = 0;
+    uint32_t high = list->block.count - 1;
+
+    while (low < high) {
+        uint32_t middle = (low + high + 1) / 2;
+        if (list->logical[middle] <= logical) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    return low;
+}
+
+// Physical block holding logical block @logical of the file open as
+// @fileDesc, with the number of physically consecutive blocks of the file
+// from there on, up to @max, in @runLength. FAT chains are followed from the
+// descriptor's cursor, extents are binary searched. Returns FAT_EOC past the
+// end of the file, with @last (if not NULL) set to its last block, or to
+// FAT_EOC for an empty file.
+uint32_t map_run(struct fs *fs, FileDescriptor *fileDesc, size_t logical, size_t max, size_t *runLength, uint32_t *last) {
+    if (!uses_extents(fs)) {
+        uint32_t block = cursor_seek(fs, fileDesc, logical, last);
+        if (block != FAT_EOC) {
+            *runLength = contiguous_run(fs, block, max);
+        }
+        return block;
+    }
+
+    ExtentList *list = extents_get(fs, fileDesc->index);
+    if (!list || logical >= list->logical[list->block.count]) {
+        if (last) {
+            *last = extents_last(list);
+        }
+        return FAT_EOC;
+    }
+
+    uint32_t found = extents_find(list, logical);
+    const Extent *extent = &list->block.extents[found];
+    size_t into = logical - list->logical[found];
+    *runLength = min(extent->length - into, max);
+    return extent->start + into;
+}
+
+// Whether the run of @runLength blocks at logical block @logical of the file
+// at table entry @index, ending on data block @lastOfRun, ends the file
+int run_ends_file(struct fs *fs, int index, size_t logical, size_t runLength, uint32_t lastOfRun) {
+    if (!uses_extents(fs)) {
+        return fat_get(fs, lastOfRun) == FAT_EOC;
+    }
+
+    ExtentList *list = extents_get(fs, index);
+    return list && logical + runLength == list->logical[list->block.count];
+}
+
+// Number of blocks of the file at table entry @index, with its last block in
+// @last (FAT_EOC for an empty file)
+size_t file_blocks(struct fs *fs, int index, uint32_t *last) {
+    if (uses_extents(fs)) {
+        ExtentList *list = extents_get(fs, index);
+        *last = extents_last(list);
+        return list ? list->logical[list->block.count] : 0;
+    }
+
+    size_t blocks = 0;
+    *last = FAT_EOC;
+    for (uint32_t block = fs->RootEntryArray[index].first_data_block_index; block != FAT_EOC; block = fat_get(fs, block)) {
+        *last = block;
+        blocks++;
+    }
+
+    return blocks;
+}
+
+// Give back every block of the file at table entry @index past its first @keep
+// blocks. Extents go whole, only the one straddling @keep is trimmed.
+void file_free(struct fs *fs, int index, size_t keep) {
+    RootEntry *entry = &fs->RootEntryArray[index];
+
+    if (!uses_extents(fs)) {
+        if (keep == 0) {
+            free_chain(fs, entry->first_data_block_index);
+            entry->first_data_block_index = FAT_EOC;
+            entry_dirty(fs, index);
+        } else {
+            uint32_t last = entry->first_data_block_index;
+            for (size_t i = 1; i < keep; i++) {
+                last = fat_get(fs, last);
+            }
+            free_chain(fs, fat_get(fs, last));
+            fat_set(fs, last, FAT_EOC);
+        }
+        cursor_reset(fs, index);
+        chain_map_drop(fs, index);
+        return;
+    }
+
+    ExtentList *list = extents_get(fs, index);
+    if (list) {
+        uint32_t count = list->block.count;
+        while (count > 0 && list->logical[count - 1] >= keep) {
+            count--;
+            free_run(fs, list->block.extents[count].start, list->block.extents[count].length);
+        }
+        if (count > 0 && list->logical[count] > keep) {
+            Extent *extent = &list->block.extents[count - 1];
+            size_t trim = list->logical[count] - keep;
+            free_run(fs, extent->start + extent->length - trim, trim);
+            extent->length -= trim;
+            list->logical[count] = keep;
+        }
+        list->block.count = count;
+        list->dirty = 1;
+    }
+
+    // An empty file does not keep its extent block
+    if (keep == 0) {
+        if (entry->first_data_block_index != FAT_EOC) {
+            fat_set(fs, entry->first_data_block_index, 0);
+            entry->first_data_block_index = FAT_EOC;
+            entry_dirty(fs, index);
+        }
+        free(list);
+        fs->extent_lists[index] = NULL;
+    }
+}
+
+// Physical block holding logical block @logical of the file at table entry
+// @index, for callers without a descriptor, or FAT_EOC past its end
+uint32_t file_block(struct fs *fs, int index, size_t logical) {
+    if (uses_extents(fs)) {
+        ExtentList *list = extents_get(fs, index);
+        if (!list || logical >= list->logical[list->block.count]) {
+            return FAT_EOC;
+        }
+        uint32_t found = extents_find(list, logical);
+        return list->block.extents[found].start + (logical - list->logical[found]);
+    }
+
+    ChainMap *map = &fs->chain_maps[index];
+    if (!map->blocks) {
+        chain_map_build(fs, index);
+    }
+    if (map->blocks) {
+        return logical < map->length ? map->blocks[logical] : FAT_EOC;
+    }
+
+    uint32_t block = fs->RootEntryArray[index].first_data_block_index;
+    for (size_t i = 0; i < logical && block != FAT_EOC; i++) {
+        block = fat_get(fs, block);
+    }
+    return block;
+}
+
+// A subdirectory is stored like a file: a header block, then bucket blocks,
+// each laid out like the root directory block. An entry lives in the bucket
+// the header picks by the low bits of its name's hash (extendible hashing).
+// When that bucket is full it alone splits, its entries sharing one more hash
+// bit with a new bucket appended to the directory; the header only doubles
+// its table when the bucket already used every bit it has. Lookups thus read
+// the header and a single bucket whatever the size.
+
+// Number of blocks of the directory at table entry @dir, header included
+size_t dir_blocks(struct fs *fs, int dir) {
+    return fs->RootEntryArray[dir].file_size / BLOCK_SIZE;
+}
+
+int dir_read(struct fs *fs, int dir, size_t logical, void *block) {
+    uint32_t dataBlock = file_block(fs, dir, logical);
+
+    if (dataBlock == FAT_EOC) {
+        fprintf(stderr, "Error: Directory block %zu is missing.\n", logical);
+        return -1;
+    }
+
+    return meta_read(fs, fs->super_block->data_block_index + dataBlock, block);
+}
+
+int dir_write(struct fs *fs, int dir, size_t logical, const void *block) {
+    uint32_t dataBlock = file_block(fs, dir, logical);
+
+    if (dataBlock == FAT_EOC) {
+        fprintf(stderr, "Error: Directory block %zu is missing.\n", logical);
+        return -1;
+    }
+
+    return meta_write(fs, fs->super_block->data_block_index + dataBlock, block, CACHE_DIR);
+}
+
+// Bucket of directory @dir where the entry named @name lives, with the header
+// read into @header. Returns -1 if the header cannot be read or is corrupt.
+int dir_home(struct fs *fs, int dir, const char *name, DirHeader *header) {
+    if (dir_read(fs, dir, 0, header) == -1) {
+        return -1;
+    }
+
+    size_t bucket = header->depth <= DIR_DEPTH_MAX ? header->buckets[name_hash32(name) & ((1u << header->depth) - 1)] : 0;
+    if (bucket == 0 || bucket >= dir_blocks(fs, dir)) {
+        fprintf(stderr, "Error: Directory header is corrupt.\n");
+        return -1;
+    }
+
+    return bucket;
+}
+
+// Slot of directory block @block holding @name (a free slot for ""), or -1
+int dir_slot(const uint8_t *block, const char *name) {
+    for (int i = 0; i < MAX_ROOT_ENTRIES; i++) {
+        if (strncmp((const char *)block + i * ENTRY_SIZE, name, MAX_FILENAME) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Append @wanted blocks to directory @dir. Returns -1, with the directory
+// left as it was, if the disk is full.
+int dir_extend(struct fs *fs, int dir, size_t wanted) {
+    size_t blocks = dir_blocks(fs, dir);
+    size_t added = 0;
+    uint32_t last;
+
+    file_blocks(fs, dir, &last);
+    while (added < wanted) {
+        size_t got = file_extend(fs, NULL, dir, &last, wanted - added);
+        if (got == 0) {
+            file_free(fs, dir, blocks);
+            fprintf(stderr, "Error: No space left to grow directory.\n");
+            return -1;
+        }
+        added += got;
+    }
+
+    fs->RootEntryArray[dir].file_size = (uint64_t)(blocks + wanted) * BLOCK_SIZE;
+    entry_dirty(fs, dir);
+    return 0;
+}
+
+// Make room in directory @dir for an entry named @name: give the directory
+// its header and first bucket, or split the full bucket @name lives in.
+// Returns -1 if the disk is full, or if the bucket cannot split any further.
+int dir_grow(struct fs *fs, int dir, const char *name) {
+    size_t blocks = dir_blocks(fs, dir);
+    DirHeader header;
+    uint8_t block[BLOCK_SIZE];
+    uint8_t sibling[BLOCK_SIZE];
+
+    if (blocks == 0) {
+        if (dir_extend(fs, dir, 2) == -1) {
+            return -1;
+        }
+        memset(&header, 0, sizeof(header));
+        header.buckets[0] = 1;
+        memset(block, 0, BLOCK_SIZE);
+        return dir_write(fs, dir, 0, &header) == -1 || dir_write(fs, dir, 1, block) == -1 ? -1 : 0;
+    }
+
+    int home = dir_home(fs, dir, name, &header);
+    if (home == -1 || dir_read(fs, dir, home, block) == -1) {
+        return -1;
+    }
+    uint32_t depth = header.bucket_depth[home - 1];
+    if (depth == DIR_DEPTH_MAX) {
+        fprintf(stderr, "Error: Directory is full.\n");
+        return -1;
+    }
+    if (dir_extend(fs, dir, 1) == -1) {
+        return -1;
+    }
+
+    // The table doubles with both halves picking the same buckets
+    if (depth == header.depth) {
+        memcpy(&header.buckets[1u << depth], header.buckets, (1u << depth) * sizeof(header.buckets[0]));
+        header.depth++;
+    }
+
+    // Entries with the new bit set move to the new bucket, and so do the
+    // hash values the header gave the full bucket for them
+    memset(sibling, 0, BLOCK_SIZE);
+    for (int i = 0; i < MAX_ROOT_ENTRIES; i++) {
+        uint8_t *entry = block + i * ENTRY_SIZE;
+        if (entry[0] != '\0' && (name_hash32((const char *)entry) & (1u << depth))) {
+            memcpy(sibling + i * ENTRY_SIZE, entry, ENTRY_SIZE);
+            memset(entry, 0, ENTRY_SIZE);
+        }
+    }
+    for (size_t i = 0; i < (1u << header.depth); i++) {
+        if (header.buckets[i] == home && (i & (1u << depth))) {
+            header.buckets[i] = blocks;
+        }
+    }
+    header.bucket_depth[home - 1] = header.bucket_depth[blocks - 1] = depth + 1;
+
+    if (dir_write(fs, dir, 0, &header) == -1 || dir_write(fs, dir, home, block) == -1 ||
+        dir_write(fs, dir, blocks, sibling) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+// Copy the entry named @name of directory @dir into @entry. Returns -1 if
+// there is none.
+int dir_find(struct fs *fs, int dir, const char *name, RootEntry *entry) {
+    uint8_t block[BLOCK_SIZE];
+
+    DirHeader header;
+
+    if (dir_blocks(fs, dir) == 0) {
+        return -1;
+    }
+
+    int home = dir_home(fs, dir, name, &header);
+    if (home == -1 || dir_read(fs, dir, home, block) == -1) {
+        return -1;
+    }
+
+    int slot = dir_slot(block, name);
+    if (slot == -1) {
+        return -1;
+    }
+
+    entry_decode(fs, block, slot, entry);
+    return 0;
+}
+
+// Write @entry to directory @dir over the entry of the same name, or with
+// @create into a free slot, growing the directory if need be
+int dir_store(struct fs *fs, int dir, const RootEntry *entry, int create) {
+    const char *name = (const char *)entry->file_name;
+    uint8_t block[BLOCK_SIZE];
+    DirHeader header;
+
+    for (;;) {
+        if (dir_blocks(fs, dir) > 0) {
+            int home = dir_home(fs, dir, name, &header);
+            if (home == -1 || dir_read(fs, dir, home, block) == -1) {
+                return -1;
+            }
+            int slot = dir_slot(block, create ? "" : name);
+            if (slot != -1) {
+                entry_encode(fs, block, slot, entry);
+                return dir_write(fs, dir, home, block);
+            }
+        }
+        if (!create || dir_grow(fs, dir, name) == -1) {
+            return -1;
+        }
+    }
+}
+
+// Clear the entry named @name from directory @dir
+int dir_remove(struct fs *fs, int dir, const char *name) {
+    uint8_t block[BLOCK_SIZE];
+    DirHeader header;
+
+    int home = dir_home(fs, dir, name, &header);
+    if (home == -1 || dir_read(fs, dir, home, block) == -1) {
+        return -1;
+    }
+
+    int slot = dir_slot(block, name);
+    if (slot == -1) {
+        return -1;
+    }
+
+    memset(block + slot * ENTRY_SIZE, 0, ENTRY_SIZE);
+    return dir_write(fs, dir, home, block);
+}
+
+// Whether directory @dir holds no entry. Unreadable directories count as
+// non-empty so that they are not deleted.
+int dir_is_empty(struct fs *fs, int dir) {
+    uint8_t block[BLOCK_SIZE];
+
+    for (size_t b = 1; b < dir_blocks(fs, dir); b++) {
+        if (dir_read(fs, dir, b, block) == -1) {
+            return 0;
+        }
+        for (int i = 0; i < MAX_ROOT_ENTRIES; i++) {
+            if (block[i * ENTRY_SIZE] != '\0') {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+// Buckets of directory @dir, header included, that the journal revokes when
+// they are freed
+size_t dir_revokes(struct fs *fs, int dir) {
+    size_t revokes = 0;
+
+    for (size_t b = 0; fs->journal && b < dir_blocks(fs, dir); b++) {
+        revokes += journal_logged(fs->journal, fs->super_block->data_block_index + file_block(fs, dir, b));
+    }
+
+    return revokes;
+}
+
+// Table entry of the entry named @name in directory @dir (ROOT_DIR or a table
+// entry), or -1 if there is none. Subdirectory entries are loaded into a free
+// table slot on first use and stay there while referenced: every successful
+// call takes a reference for entry_put() to drop, and a loaded entry holds
+// one on its directory.
+int entry_get(struct fs *fs, int dir, const char *name) {
+    int index = name_index_lookup(fs, dir, name);
+
+    if (index != -1) {
+        fs->entry_links[index].refs++;
+        return index;
+    }
+    if (dir == ROOT_DIR) {
+        return -1;
+    }
+
+    RootEntry entry;
+    if (dir_find(fs, dir, name, &entry) == -1) {
+        return -1;
+    }
+
+    index = first_free_entry(fs, MAX_ROOT_ENTRIES, TABLE_ENTRIES);
+    if (index == -1) {
+        fprintf(stderr, "Error: Too many directory entries in use.\n");
+        return -1;
+    }
+
+    fs->RootEntryArray[index] = entry;
+    fs->entry_links[index] = (EntryLink){ .parent = dir, .refs = 1 };
+    fs->entry_links[dir].refs++;
+    name_index_insert(fs, index);
+    return index;
+}
+
+// Drop a reference taken by entry_get(). A loaded entry that is no longer
+// referenced is written back if needed and leaves the table, dropping its own
+// reference on its directory in turn.
+void entry_put(struct fs *fs, int index) {
+    while (index >= MAX_ROOT_ENTRIES && --fs->entry_links[index].refs == 0) {
+        int parent = fs->entry_links[index].parent;
+
+        if (fs->entry_links[index].dirty || (fs->extent_lists[index] && fs->extent_lists[index]->dirty)) {
+            flush_metadata(fs);
+        }
+        name_index_remove(fs, index);
+        chain_map_drop(fs, index);
+        free(fs->extent_lists[index]);
+        fs->extent_lists[index] = NULL;
+        memset(&fs->RootEntryArray[index], 0, sizeof(RootEntry));
+        fs->entry_links[index] = (EntryLink){ .parent = ROOT_DIR };
+        index = parent;
+    }
+}
+
+// Resolve every component of @path but the last one, which is copied to
+// @name. The directory holding it comes back in @dir (ROOT_DIR or a table
+// entry referenced for the caller). Components are 1 to MAX_FILENAME - 1
+// characters separated by '/', with an optional leading '/'. Returns -1 if
+// @path is malformed or one of its directories does not exist.
+int path_lookup(struct fs *fs, const char *path, int *dir, char *name) {
+    int current = ROOT_DIR;
+
+    if (!path) {
+        return -1;
+    }
+    while (*path == '/') {
+        path++;
+    }
+
+    for (;;) {
+        const char *end = strchr(path, '/');
+        size_t length = end ? (size_t)(end - path) : strlen(path);
+
+        if (length == 0 || length >= MAX_FILENAME) {
+            entry_put(fs, current);
+            return -1;
+        }
+        memcpy(name, path, length);
+        name[length] = '\0';
+
+        if (!end) {
+            *dir = current;
+            return 0;
+        }
+
+        int next = entry_get(fs, current, name);
+        entry_put(fs, current);
+        if (next == -1) {
+            return -1;
+        }
+        if (fs->RootEntryArray[next].type != ENTRY_DIRECTORY) {
+            entry_put(fs, next);
+            return -1;
+        }
+        current = next;
+        path = end + 1;
+    }
+}
+
+// Add an empty entry of @type named @name to directory @dir
+int entry_create(struct fs *fs, int dir, const char *name, uint8_t type) {
+    int existing = entry_get(fs, dir, name);
+
+    if (existing != -1) {
+        entry_put(fs, existing);
+        fprintf(stderr, "Error: File already exists.\n");
+        return -1;
+    }
+
+    RootEntry entry = {0};
+    strcpy((char *)entry.file_name, name);
+    entry.file_size = 0;
+    entry.first_data_block_index = FAT_EOC; // Indicating no data blocks are allocated yet
+    entry.type = type;
+
+    if (dir == ROOT_DIR) {
+        // Look for an empty entry in the root directory
+        int emptyEntry = first_free_entry(fs, 0, MAX_ROOT_ENTRIES);
+        if (emptyEntry == -1) {
+            fprintf(stderr, "Error: Root directory is full.\n");
+            return -1;
+        }
+        fs->RootEntryArray[emptyEntry] = entry;
+        name_index_insert(fs, emptyEntry);
+        fs->root_dirty = 1;
+    } else if (dir_store(fs, dir, &entry, 1) == -1) {
+        return -1;
+    }
+
+    // Write the updated directory back to disk
+    return flush_metadata(fs);
+}
+
+// First data block of @entry, as shown by fs_ls()
+uint32_t first_data_block(struct fs *fs, const RootEntry *entry) {
+    ExtentBlock block;
+
+    if (!uses_extents(fs) || entry->first_data_block_index == FAT_EOC) {
+        return entry->first_data_block_index;
+    }
+    if (meta_read(fs, fs->super_block->data_block_index + entry->first_data_block_index, &block) == -1 || block.count == 0) {
+        return FAT_EOC;
+    }
+
+    return block.extents[0].start;
+}
+
+void print_entry(struct fs *fs, const RootEntry *entry) {
+    printf("%s: %s, size: %" PRIu64 ", data_blk: %" PRIu32 "\n",
+           entry->type == ENTRY_DIRECTORY ? "dir" : "file",
+           entry->file_name,
+           entry->file_size,
+           block_encode(fs, first_data_block(fs, entry)));
+}
+
+// Create an empty entry of @type at @path. Returns OP_RETRY if the running
+// transaction must commit first, see op_reserve().
+int path_create(struct fs *fs, const char *path, uint8_t type) {
+    int dir;
+    char name[MAX_FILENAME];
+    if (path_lookup(fs, path, &dir, name) == -1) {
+        fprintf(stderr, "Error: Filename is invalid or too long.\n");
+        return -1;
+    }
+
+    // The root block, or every directory block a growth may write: the header,
+    // the buckets it splits, their FAT blocks and extent block, and the
+    // directory's own entry
+    size_t credits = dir == ROOT_DIR ? 1 : fat_credits(fs, DIR_GROW_BLOCKS) + DIR_DEPTH_MAX + 4;
+    int ret = op_reserve(fs, dir == ROOT_DIR ? 0 : DIR_GROW_BLOCKS, credits);
+    if (ret == 0) {
+        ret = entry_create(fs, dir, name, type);
+        op_end(fs, credits);
+    }
+    entry_put(fs, dir);
+    return ret;
+}
+
+// Commit the running transaction for a namespace change turned back by
+// op_reserve(), with namespace_lock() released meanwhile
+int namespace_commit(struct fs *fs) {
+    namespace_unlock(fs);
+    int ret = op_commit(fs);
+    namespace_lock(fs);
+    return ret;
+}
+
+int fs_create_h(fs_t *fs, const char *filename)
+{
+	if (!is_mounted(fs)) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;
+    }
+
+    namespace_lock(fs);
+    int ret = path_create(fs, filename, ENTRY_FILE);
+    while (ret == OP_RETRY) {
+        ret = namespace_commit(fs) == -1 ? -1 : path_create(fs, filename, ENTRY_FILE);
+    }
+    namespace_unlock(fs);
+    return ret;
+}
+
+int fs_mkdir_h(fs_t *fs, const char *path)
+{
+	if (!is_mounted(fs)) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;
+    }
+
+    // Its first block is only allocated with its first entry
+    namespace_lock(fs);
+    int ret = path_create(fs, path, ENTRY_DIRECTORY);
+    while (ret == OP_RETRY) {
+        ret = namespace_commit(fs) == -1 ? -1 : path_create(fs, path, ENTRY_DIRECTORY);
+    }
+    namespace_unlock(fs);
+    return ret;
+}
+
+// Delete the file or empty directory at @path. Returns OP_RETRY if the running
+// transaction must commit first, see op_reserve().
+int path_delete(struct fs *fs, const char *filename) {
+    int dir;
+    char name[MAX_FILENAME];
+    if (path_lookup(fs, filename, &dir, name) == -1) {
+        fprintf(stderr, "Error: Filename is invalid or too long.\n");
+        return -1;
+    }
+    // Check if file exists
+    int fileIndex = entry_get(fs, dir, name);
+    if (fileIndex == -1) {
+        entry_put(fs, dir);
+        fprintf(stderr, "Error: File not found.\n");
+        return -1;
+    }
+
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fs->fd_table[i] && fs->fd_table[i]->index == fileIndex) {
+            entry_put(fs, fileIndex);
+            entry_put(fs, dir);
+            fprintf(stderr, "Error: File is currently open.\n");
+            return -1;
+        }
+    }
+    if (fs->RootEntryArray[fileIndex].type == ENTRY_DIRECTORY && !dir_is_empty(fs, fileIndex)) {
+        entry_put(fs, fileIndex);
+        entry_put(fs, dir);
+        fprintf(stderr, "Error: Directory is not empty.\n");
+        return -1;
+    }
+
+    // The FAT blocks of every block, extent block included, the revoked
+    // extent block and the block losing the entry, plus the revoked buckets
+    // of a directory. Emptying the log first spares those that do not fit.
+    uint32_t last;
+    size_t blocks = file_blocks(fs, fileIndex, &last);
+    size_t credits = fat_credits(fs, blocks + 1) + 2;
+    if (fs->RootEntryArray[fileIndex].type == ENTRY_DIRECTORY) {
+        size_t revokes = dir_revokes(fs, fileIndex);
+        if (revokes > 0 && credits + revokes > journal_capacity(fs->journal)) {
+            if (journal_checkpoint(fs->journal) == -1) {
+                entry_put(fs, fileIndex);
+                entry_put(fs, dir);
+                return -1;
+            }
+            revokes = dir_revokes(fs, fileIndex);
+        }
+        credits += revokes;
+    }
+    int reserved = op_reserve(fs, 0, credits);
+    if (reserved != 0) {
+        entry_put(fs, fileIndex);
+        entry_put(fs, dir);
+        return reserved;
+    }
+
+    // Free the file's blocks
+    file_free(fs, fileIndex, 0);
+
+    int ret = 0;
+    if (dir == ROOT_DIR) {
+        name_index_remove(fs, fileIndex);
+        memset(&fs->RootEntryArray[fileIndex], 0, sizeof(RootEntry));
+        fs->root_dirty = 1;
+    } else {
+        ret = dir_remove(fs, dir, name);
+        fs->entry_links[fileIndex].dirty = 0; // Nothing left to write back
+    }
+
+    // Write the modified FAT blocks and the directory back to disk, once each
+    if (flush_metadata(fs) == -1) {
+        ret = -1;
+    }
+    op_end(fs, credits);
+    entry_put(fs, fileIndex);
+    entry_put(fs, dir);
+    return ret;
+}
+
+int fs_delete_h(fs_t *fs, const char *filename)
+{
+    if (!is_mounted(fs)) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;
+    }
+
+    namespace_lock(fs);
+    int ret = path_delete(fs, filename);
+    while (ret == OP_RETRY) {
+        ret = namespace_commit(fs) == -1 ? -1 : path_delete(fs, filename);
+    }
+    namespace_unlock(fs);
+    return ret;
+}
+
+int fs_ls_h(fs_t *fs)
+{
+    if (!is_mounted(fs)) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;
+    } 
+
+    printf("FS Ls:\n");
+
+    // Iterate through the Root Directory
+    pthread_rwlock_rdlock(&fs->dir_lock);
+    pthread_rwlock_rdlock(&fs->fat_lock);
+    for (int i = 0; i < MAX_ROOT_ENTRIES; i++) {
+        // Check if the entry is valid (non-empty)
+        if (fs->RootEntryArray[i].file_name[0] != '\0') {
+            print_entry(fs, &fs->RootEntryArray[i]);
+        }
+    }
+    pthread_rwlock_unlock(&fs->fat_lock);
+    pthread_rwlock_unlock(&fs->dir_lock);
+
+    return 0;
+}
+
+// List the entries of the subdirectory at @path
+int path_list(struct fs *fs, const char *path) {
+    int dir;
+    char name[MAX_FILENAME];
+    if (path_lookup(fs, path, &dir, name) == -1) {
+        fprintf(stderr, "Error: Directory not found.\n");
+        return -1;
+    }
+    int index = entry_get(fs, dir, name);
+    entry_put(fs, dir);
+    if (index == -1 || fs->RootEntryArray[index].type != ENTRY_DIRECTORY) {
+        entry_put(fs, index);
+        fprintf(stderr, "Error: Directory not found.\n");
+        return -1;
+    }
+
+    printf("FS Ls:\n");
+
+    int ret = 0;
+    uint8_t block[BLOCK_SIZE];
+    for (size_t b = 1; b < dir_blocks(fs, index) && ret == 0; b++) {
+        if (dir_read(fs, index, b, block) == -1) {
+            ret = -1;
+            break;
+        }
+        for (int i = 0; i < MAX_ROOT_ENTRIES; i++) {
+            if (block[i * ENTRY_SIZE] != '\0') {
+                RootEntry entry;
+                entry_decode(fs, block, i, &entry);
+                print_entry(fs, &entry);
+            }
+        }
+    }
+
+    entry_put(fs, index);
+    return ret;
+}
+
+int fs_lsdir_h(fs_t *fs, const char *path)
+{
+    if (!is_mounted(fs)) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;
+    }
+
+    while (path && *path == '/') {
+        path++;
+    }
+    if (path && *path == '\0') {
+        return fs_ls_h(fs);
+    }
+
+    // Loading the directory's entries changes the entry table
+    namespace_lock(fs);
+    int ret = path_list(fs, path);
+    namespace_unlock(fs);
+    return ret;
+}
+
+// Open the file at @filename in a free descriptor
+int path_open(struct fs *fs, const char *filename) {
+    int fd = -1;
+
+    int dir;
+    char name[MAX_FILENAME];
+    if (path_lookup(fs, filename, &dir, name) == -1) {
+        fprintf(stderr, "Error: Filename is invalid or too long.\n");
+        return -1;
+    }
+    // Check if file exists; the descriptor keeps the reference until fs_close()
+    int fileIndex = entry_get(fs, dir, name);
+    entry_put(fs, dir);
+    // Check if file is found 
+    if (fileIndex == -1) {
+        fprintf(stderr, "Error: File not found.\n");
+        return -1;
+    }
+    if (fs->RootEntryArray[fileIndex].type == ENTRY_DIRECTORY) {
+        entry_put(fs, fileIndex);
+        fprintf(stderr, "Error: Cannot open a directory.\n");
+        return -1;
+    }
+
+    // Look for spot in file descriptor table.
+    // Available spots set to NULL when mounting to establish an empty table.
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fs->fd_table[i] == NULL) {  // Found an available spot
+            fs->fd_table[i] = malloc(sizeof(FileDescriptor));
+            if (fs->fd_table[i] == NULL) {
+                fprintf(stderr, "Failed to allocate memory for FD.\n");
+                entry_put(fs, fileIndex);
+                return -1;  // Failed to allocate memory for FD
+            }
+            fs->fd_table[i]->offset = 0;  // Initialize file offset to 0
+            fs->fd_table[i]->index = fileIndex;  // Store the index of the file in the entry table
+            fs->fd_table[i]->in_use = 1;  // Mark FD as in use
+            fs->fd_table[i]->window_start = 0;  // No blocks preallocated yet
+            fs->fd_table[i]->window_end = 0;
+            fs->fd_table[i]->cursor_logical = 0;  // Chain not walked yet
+            fs->fd_table[i]->cursor_block = FAT_EOC;
+            fs->fd_table[i]->queue = NULL;
+            fs->fd_table[i]->ra_offset = 0;  // A first read from the start is sequential
+            fs->fd_table[i]->ra_window = 0;
+            fs->fd_table[i]->ra_end = 0;
+            fs->fd_table[i]->ra_block = FAT_EOC;
+            fs->fd_table[i]->wb_block = FAT_EOC;  // Nothing buffered
+            fs->fd_table[i]->wb_dirty = 0;
+            fd = i;  // FD is the index in the fd_table
+            break;
+        }
+    }
+
+    if (fd == -1) {
+        fprintf(stderr, "Error: No available file descriptor spot.\n");
+        entry_put(fs, fileIndex);
+        return -1;  // No available file descriptor spot
+    }
+    
+    return fd;  // Return the file descriptor
+}
+
+int fs_open_h(fs_t *fs, const char *filename)
+{
+    if (!is_mounted(fs)) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;  // Filesystem not mounted
+    }
+
+    namespace_lock(fs);
+    int fd = path_open(fs, filename);
+    namespace_unlock(fs);
+    return fd;
+}
+
+int fs_close_h(fs_t *fs, int fd)
+{
+    if (!is_mounted(fs)) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;
+    }
+
+    // Check if the file descriptor is within the valid range
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
+        fprintf(stderr, "FD %d is not in valid range [0, %d).\n", fd, FS_OPEN_MAX_COUNT);
+        return -1; // Invalid file descriptor
+    }
+
+    namespace_lock(fs);
+
+    // Check if the file descriptor is actually in use
+    if (fs->fd_table[fd] == NULL || fs->fd_table[fd]->in_use == 0) {
+        namespace_unlock(fs);
+        fprintf(stderr, "File not in use\n");
+        return -1; // File descriptor not in use or invalid
+    }
+
+    int index = fs->fd_table[fd]->index;
+
+    // Buffered writes, and the size they gave the file, reach the cache
+    int flushed = write_behind_flush(fs, fs->fd_table[fd], 1);
+    if (flush_metadata(fs) == -1) {
+        flushed = -1;
+    }
+
+    // Free the allocated memory for the file descriptor
+    if (fs->fd_table[fd]->queue) {
+        block_queue_close(fs->fd_table[fd]->queue);
+    }
+    free(fs->fd_table[fd]);
+    // Mark the slot as available again
+    fs->fd_table[fd] = NULL;
+    entry_put(fs, index);
+
+    namespace_unlock(fs);
+    return flushed; // Closed, even if buffered writes could not be flushed
+}
+
+int is_valid_fd(struct fs *fs, int fd) {
+    return (fd >= 0 && fd < FS_OPEN_MAX_COUNT && fs->fd_table[fd] != NULL && fs->fd_table[fd]->in_use != 0);
+}
+
+// Descriptor @fd with its file locked, and the entry table held shared so that
+// neither goes away, until file_unlock(). Returns NULL, with nothing held, if
+// @fd is not open.
+FileDescriptor *file_lock(struct fs *fs, int fd) {
+    pthread_rwlock_rdlock(&fs->dir_lock);
+    if (!is_valid_fd(fs, fd)) {
+        pthread_rwlock_unlock(&fs->dir_lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&fs->file_locks[fs->fd_table[fd]->index]);
+    return fs->fd_table[fd];
+}
+
+void file_unlock(struct fs *fs, FileDescriptor *fileDesc) {
+    pthread_mutex_unlock(&fs->file_locks[fileDesc->index]);
+    pthread_rwlock_unlock(&fs->dir_lock);
+}
+
+// file_lock() for an operation that allocates up to @blocks data blocks and
+// stages up to @credits, once op_reserve() lets it go ahead
+FileDescriptor *file_start(struct fs *fs, int fd, size_t blocks, size_t credits) {
+    for (;;) {
+        FileDescriptor *fileDesc = file_lock(fs, fd);
+        if (!fileDesc) {
+            return NULL;
+        }
+
+        pthread_rwlock_rdlock(&fs->fat_lock);
+        int ret = op_reserve(fs, blocks, credits);
+        pthread_rwlock_unlock(&fs->fat_lock);
+        if (ret == 0) {
+            return fileDesc;
+        }
+
+        file_unlock(fs, fileDesc);
+        if (ret == -1 || op_commit(fs) == -1) {
+            return NULL;
+        }
+    }
+}
+
+ssize_t fs_stat_h(fs_t *fs, int fd)
+{
+    if (!is_mounted(fs)) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;
+    }
+
+    FileDescriptor *fileDesc = file_lock(fs, fd);
+    if (!fileDesc) {
+        fprintf(stderr, "Error: Invalid file descriptor.\n");
+        return -1;
+    }
+
+    // Retrieve and return the size of the file associated with the file descriptor
+    ssize_t fileSize = fs->RootEntryArray[fileDesc->index].file_size;
+    file_unlock(fs, fileDesc);
+    return fileSize;
+}
+
+int fs_lseek_h(fs_t *fs, int fd, size_t offset)
+{
+    if (!is_mounted(fs)) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;
+    }
+
+    FileDescriptor *fileDesc = file_lock(fs, fd);
+    if (!fileDesc) {
+        fprintf(stderr, "Error: Invalid file descriptor.\n");
+        return -1;
+    }
+
+    // Get the size of the file associated with the file descriptor
+    size_t fileSize = fs->RootEntryArray[fileDesc->index].file_size;
+
+    // Validate the offset
+    if (offset > fileSize) {
+        file_unlock(fs, fileDesc);
+        fprintf(stderr, "Error: Offset is larger than the file size.\n");
+        return -1;
+    }
+
+    fileDesc->offset = offset;
+
+    // Move the cursor along with the offset, so that forward seeks only walk
+    // the blocks in between (extents need no cursor)
+    if (!uses_extents(fs)) {
+        pthread_rwlock_rdlock(&fs->fat_lock);
+        cursor_seek(fs, fileDesc, offset / BLOCK_SIZE, NULL);
+        pthread_rwlock_unlock(&fs->fat_lock);
+    }
+
+    file_unlock(fs, fileDesc);
+    return 0; 
+}
+
+
+
+
+// Read the whole blocks gathered in @batch, with all their disk reads in flight
+// at once when there are several runs
+int read_batch_flush(struct fs *fs, FileDescriptor *fileDesc, ReadBatch *batch) {
+    if (batch->count == 0 || batch->failed) {
+        return batch->failed ? -1 : 0;
+    }
+
+    // Without a queue the runs are simply read in turn
+    if (batch->count > 1 && fileDesc->queue == NULL) {
+        fileDesc->queue = block_queue_open_h(fs->disk, 0);
+    }
+
+    if (cache_read_ranges(fs->cache, fileDesc->queue, batch->ranges, batch->count) == -1) {
+        batch->failed = 1;
+        return -1;
+    }
+
+    batch->count = 0;
+    return 0;
+}
+
+// Copy @length bytes, starting @offset bytes into the consecutive blocks at
+// @blockIndex, to @dst. Whole blocks are added to @batch, to be read straight
+// into @dst, only a partial first or last block goes through the descriptor's
+// bounce buffer.
+int read_run(struct fs *fs, FileDescriptor *fileDesc, size_t blockIndex, size_t offset, size_t length, char *dst,
+             ReadBatch *batch) {
+    // Copy straight out of the disk mapping when there is one
+    const char *mapped = cache_map_range(fs->cache, blockIndex, (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    if (mapped) {
+        memcpy(dst, mapped + offset, length);
+        return 0;
+    }
+
+    // Partial head block
+    if (offset != 0 || length < BLOCK_SIZE) {
+        size_t bytes = min(BLOCK_SIZE - offset, length);
+        if (cache_read(fs->cache, blockIndex, fileDesc->bounce) == -1) {
+            return -1;
+        }
+        memcpy(dst, fileDesc->bounce + offset, bytes);
+        dst += bytes;
+        length -= bytes;
+        blockIndex++;
+    }
+
+    // Whole blocks
+    size_t wholeBlocks = length / BLOCK_SIZE;
+    if (wholeBlocks > 0) {
+        if (batch->count == READ_BATCH_RUNS && read_batch_flush(fs, fileDesc, batch) == -1) {
+            return -1;
+        }
+        batch->ranges[batch->count].block = blockIndex;
+        batch->ranges[batch->count].count = wholeBlocks;
+        batch->ranges[batch->count].buf = dst;
+        batch->count++;
+        dst += wholeBlocks * BLOCK_SIZE;
+        length -= wholeBlocks * BLOCK_SIZE;
+        blockIndex += wholeBlocks;
+    }
+
+    // Partial tail block
+    if (length > 0) {
+        if (cache_read(fs->cache, blockIndex, fileDesc->bounce) == -1) {
+            return -1;
+        }
+        memcpy(dst, fileDesc->bounce, length);
+    }
+
+    return 0;
+}
+
+// Adapt the read-ahead window of @fileDesc to the read that just ended, which
+// started at @start, then start reading the blocks ahead that are missing in
+// the background. A read picking up where the previous one ended doubles the
+// window when it lands on blocks read ahead, any other read halves it.
+void read_ahead(struct fs *fs, FileDescriptor *fileDesc, size_t start) {
+    if (start == fileDesc->ra_offset) {
+        if (fileDesc->ra_window == 0) {
+            fileDesc->ra_window = READAHEAD_MIN;
+        } else if (start / BLOCK_SIZE < fileDesc->ra_end) {
+            fileDesc->ra_window = min(2 * fileDesc->ra_window, READAHEAD_MAX);
+        }
+    } else {
+        fileDesc->ra_window /= 2;
+        fileDesc->ra_end = 0;
+        fileDesc->ra_block = FAT_EOC;
+    }
+    fileDesc->ra_offset = fileDesc->offset;
+
+    // Top the window up once half of it has been read
+    size_t fileSize = fs->RootEntryArray[fileDesc->index].file_size;
+    size_t next = fileDesc->offset / BLOCK_SIZE;
+    size_t target = min(next + fileDesc->ra_window, (fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    size_t logical = fileDesc->ra_end > next ? fileDesc->ra_end : next;
+    if (logical >= target || (target - logical < fileDesc->ra_window / 2 && target < (fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE)) {
+        return;
+    }
+
+    if (fileDesc->queue == NULL && (fileDesc->queue = block_queue_open_h(fs->disk, 0)) == NULL) {
+        return;
+    }
+
+    // Map the blocks from where read-ahead stopped, leaving the read cursor
+    // where it is
+    uint32_t cursorLogical = fileDesc->cursor_logical;
+    uint32_t cursorBlock = fileDesc->cursor_block;
+    if (logical > 0 && logical == fileDesc->ra_end && fileDesc->ra_block != FAT_EOC) {
+        fileDesc->cursor_logical = logical - 1;
+        fileDesc->cursor_block = fileDesc->ra_block;
+    }
+
+    pthread_rwlock_rdlock(&fs->fat_lock);
+    while (logical < target) {
+        size_t runLength;
+        uint32_t block = map_run(fs, fileDesc, logical, target - logical, &runLength, NULL);
+        if (block == FAT_EOC) {
+            break;
+        }
+        fileDesc->cursor_logical = logical + runLength - 1;
+        fileDesc->cursor_block = block + runLength - 1;
+        if (cache_prefetch(fs->cache, fileDesc->queue, fs->super_block->data_block_index + block, runLength) == -1) {
+            break;
+        }
+        logical += runLength;
+        fileDesc->ra_end = logical;
+        fileDesc->ra_block = block + runLength - 1;
+    }
+    pthread_rwlock_unlock(&fs->fat_lock);
+
+    fileDesc->cursor_logical = cursorLogical;
+    fileDesc->cursor_block = cursorBlock;
+}
+
+ssize_t fs_read_h(fs_t *fs, int fd, void *buf, size_t count) {
+    FileDescriptor *fileDesc = NULL;
+    if (!is_mounted(fs) || buf == NULL || (fileDesc = file_lock(fs, fd)) == NULL) {
+        fprintf(stderr, "Error: failed intial check read.\n");
+        return -1; // Check for mounted FS, valid FD, and non-null buffer
+    }
+    count = min(count, (size_t)SSIZE_MAX); // So that the byte count can be returned
+
+    size_t fileSize = fs->RootEntryArray[fileDesc->index].file_size;
+    size_t fileOffset = fileDesc->offset;
+    size_t bytesToRead = fileOffset < fileSize ? min(count, fileSize - fileOffset) : 0;
+    size_t bytesRead = 0;
+    ReadBatch batch = { .count = 0, .failed = 0 };
+
+    // Reads go through the cache and use the bounce buffer themselves
+    if (write_behind_flush_file(fs, fileDesc->index, NULL) == -1) {
+        file_unlock(fs, fileDesc);
+        return -1;
+    }
+
+    // Blocks read ahead by the previous call go into the cache first
+    if (fileDesc->queue) {
+        block_queue_complete(fileDesc->queue, block_queue_pending(fileDesc->queue));
+    }
+
+    while (bytesToRead > 0) {
+        size_t blockOffset = fileOffset % BLOCK_SIZE;
+        size_t blocksNeeded = (blockOffset + bytesToRead + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        size_t runLength;
+
+        // Read as many physically consecutive blocks as possible at once,
+        // picking up the chain where the previous call left it
+        pthread_rwlock_rdlock(&fs->fat_lock);
+        uint32_t currentBlock = map_run(fs, fileDesc, fileOffset / BLOCK_SIZE, min(blocksNeeded, RUN_MAX_BLOCKS), &runLength, NULL);
+        pthread_rwlock_unlock(&fs->fat_lock);
+        if (currentBlock == FAT_EOC) {
+            break;
+        }
+        size_t blockIndex = fs->super_block->data_block_index + currentBlock; // Calculate actual block index
+        size_t bytesInRun = min(runLength * BLOCK_SIZE - blockOffset, bytesToRead);
+
+        if (read_run(fs, fileDesc, blockIndex, blockOffset, bytesInRun, buf + bytesRead, &batch) == -1) {
+            fprintf(stderr, "Error reading block\n");
+            break;
+        }
+
+        // Leave the cursor on the last block of the run
+        fileDesc->cursor_logical = fileOffset / BLOCK_SIZE + runLength - 1;
+        fileDesc->cursor_block = currentBlock + runLength - 1;
+
+        bytesRead += bytesInRun;
+        bytesToRead -= bytesInRun;
+        fileOffset += bytesInRun;
+    }
+
+    // Only the bytes before the first batched run count if the batch fails
+    if (read_batch_flush(fs, fileDesc, &batch) == -1) {
+        fprintf(stderr, "Error reading block\n");
+        bytesRead = (char *)batch.ranges[0].buf - (char *)buf;
+    }
+
+    fileDesc->offset += bytesRead; // Update the file descriptor's offset
+    read_ahead(fs, fileDesc, fileDesc->offset - bytesRead);
+    file_unlock(fs, fileDesc);
+
+    return bytesRead; // Return the number of bytes read
+}
+
+// Index of the first free data block at or after @from, or the data block
+// amount if there is none
+size_t next_free_block(struct fs *fs, size_t from) {
+    size_t words = (fs->super_block->data_block_amount + 63) / 64;
+
+    if (from >= fs->super_block->data_block_amount) {
+        return fs->super_block->data_block_amount;
+    }
+
+    size_t w = from / 64;
+    fat_load_word(fs, w);
+    uint64_t word = fs->free_bitmap[w] & (~0ULL << (from % 64));
+    while (word == 0) {
+        if (++w >= words) {
+            return fs->super_block->data_block_amount;
+        }
+        fat_load_word(fs, w);
+        word = fs->free_bitmap[w];
+    }
+
+    return w * 64 + __builtin_ctzll(word);
+}
+
+// Number of consecutive blocks from @start on, up to @max, that are free and
+// not held in the preallocation window of a descriptor other than @self
+size_t available_run(struct fs *fs, const FileDescriptor *self, size_t start, size_t max) {
+    size_t length = 0;
+
+    // Count free bits a word at a time
+    while (length < max && start + length < fs->super_block->data_block_amount) {
+        size_t i = start + length;
+        fat_load_word(fs, i / 64);
+        uint64_t used = ~fs->free_bitmap[i / 64] >> (i % 64);
+        size_t freeHere = used ? (size_t)__builtin_ctzll(used) : 64 - i % 64;
+
+        length += freeHere;
+        if (freeHere < 64 - i % 64) {
+            break;
+        }
+    }
+    length = min(length, max);
+    length = min(length, fs->super_block->data_block_amount - start);
+
+    // Stop at windows reserved by other open files
+    for (int fd = 0; fd < FS_OPEN_MAX_COUNT && length > 0; fd++) {
+        const FileDescriptor *other = fs->fd_table[fd];
+        if (!other || other == self || other->window_start >= other->window_end) {
+            continue;
+        }
+        if (start >= other->window_start && start < other->window_end) {
+            length = 0;
+        } else if (other->window_start > start && other->window_start < start + length) {
+            length = other->window_start - start;
+        }
+    }
+
+    return length;
+}
+
+// Find the longest available run, up to @wanted blocks, searching from the
+// next-fit hint. Returns its length and stores its first block in @first.
+size_t find_free_run(struct fs *fs, const FileDescriptor *self, size_t wanted, uint32_t *first) {
+    size_t best = 0;
+    size_t pos = fs->alloc_hint;
+    int wrapped = 0;
+
+    for (;;) {
+        size_t i = next_free_block(fs, pos);
+        if (i >= fs->super_block->data_block_amount) {
+            if (wrapped) {
+                break;
+            }
+            wrapped = 1;
+            pos = 0;
+            continue;
+        }
+        if (wrapped && i >= fs->alloc_hint) {
+            break;
+        }
+
+        size_t length = available_run(fs, self, i, wanted);
+        if (length > best) {
+            best = length;
+            *first = i;
+            if (length == wanted) {
+                break;
+            }
+        }
+        pos = i + (length ? length : 1);
+    }
+
+    return best;
+}
+
+// Allocate up to @wanted physically contiguous blocks for the file open as
+// @self (NULL when no descriptor is involved), preferably starting at @goal,
+// the block right after the file's current last block. The blocks are chained
+// together in the FAT and the last one is marked as end of chain.
+// Returns the number of blocks allocated and stores the first one in @first.
+size_t allocate_run(struct fs *fs, FileDescriptor *self, uint32_t goal, size_t wanted, uint32_t *first) {
+    size_t length = 0;
+
+    if (wanted == 0 || fs->free_block_count == 0) {
+        return 0;
+    }
+
+    // Blocks already set aside for this file
+    if (self && self->window_start < self->window_end) {
+        length = available_run(fs, self, self->window_start, min(wanted, (size_t)(self->window_end - self->window_start)));
+        *first = self->window_start;
+    }
+    // Right behind the file's last block, so the file stays sequential
+    if (length == 0 && goal < fs->super_block->data_block_amount) {
+        length = available_run(fs, self, goal, wanted);
+        *first = goal;
+    }
+    // Anywhere else, looking for room for the preallocation window as well
+    if (length == 0) {
+        length = find_free_run(fs, self, wanted + (self ? PREALLOC_BLOCKS : 0), first);
+        if (length == 0) {
+            return 0;
+        }
+        length = min(length, wanted);
+        fs->alloc_hint = (*first + length) % fs->super_block->data_block_amount;
+    }
+
+    // Chain the run together and terminate it; the FAT of an extent disk only
+    // marks blocks in use
+    for (size_t i = 0; i < length; i++) {
+        fat_set(fs, *first + i, i + 1 < length && !uses_extents(fs) ? *first + i + 1 : FAT_EOC);
+    }
+
+    // Keep the free blocks that follow reserved for this file's next writes
+    if (self && length > 0) {
+        self->window_start = *first + length;
+        self->window_end = self->window_start + available_run(fs, self, self->window_start, PREALLOC_BLOCKS);
+    }
+
+    return length;
+}
+
+// Append up to @wanted blocks, as one physically contiguous run, to the file
+// at table entry @index open as @self, whose last block is @last (FAT_EOC for an
+// empty file). @last is moved to the new last block. Returns the number of
+// blocks added.
+size_t file_extend(struct fs *fs, FileDescriptor *self, int index, uint32_t *last, size_t wanted) {
+    RootEntry *entry = &fs->RootEntryArray[index];
+    uint32_t goal = *last != FAT_EOC ? *last + 1 : FAT_EOC;
+    uint32_t first;
+    size_t got;
+
+    if (!uses_extents(fs)) {
+        got = allocate_run(fs, self, goal, wanted, &first);
+        if (got == 0) {
+            return 0;
+        }
+        if (*last != FAT_EOC) {
+            fat_set(fs, *last, first);
+        } else {
+            entry->first_data_block_index = first;
+            entry_dirty(fs, index);
+        }
+        chain_map_drop(fs, index);
+        *last = first + got - 1;
+        return got;
+    }
+
+    ExtentList *list = extents_get(fs, index);
+    if (!list) {
+        return 0;
+    }
+
+    // The file's first blocks come with its extent block, written out on the
+    // next flush even if it ends up empty
+    uint32_t extentBlock = FAT_EOC;
+    if (entry->first_data_block_index == FAT_EOC) {
+        if (allocate_run(fs, NULL, FAT_EOC, 1, &extentBlock) == 0) {
+            return 0;
+        }
+        memset(list, 0, sizeof(ExtentList));
+        list->dirty = 1;
+        entry->first_data_block_index = extentBlock;
+        entry_dirty(fs, index);
+    }
+
+    got = allocate_run(fs, self, goal, wanted, &first);
+    if (got == 0) {
+        // Give the extent block back rather than leave the file pointing at it
+        if (extentBlock != FAT_EOC) {
+            free_run(fs, extentBlock, 1);
+            entry->first_data_block_index = FAT_EOC;
+            list->dirty = 0;
+        }
+        return 0;
+    }
+
+    // Grow the last extent when the run follows it, otherwise start a new one
+    uint32_t count = list->block.count;
+    if (count > 0 && extents_last(list) + 1 == first) {
+        list->block.extents[count - 1].length += got;
+    } else if (count < EXTENTS_PER_BLOCK) {
+        list->block.extents[count].start = first;
+        list->block.extents[count].length = got;
+        list->block.count = ++count;
+        list->logical[count] = list->logical[count - 1];
+    } else {
+        fprintf(stderr, "Error: File has too many extents.\n");
+        free_run(fs, first, got);
+        return 0;
+    }
+    list->logical[count] += got;
+    list->dirty = 1;
+
+    *last = first + got - 1;
+    return got;
+}
+
+// Merge @length bytes into the partial block at @blockIndex, starting @offset
+// bytes in. The block is then held in the descriptor's bounce buffer, where
+// later small writes to it are buffered, and only reaches the cache once it
+// is full or when another block takes its place. The old content is only read
+// when the block holds file data, that is when its file position @blockStart
+// is below @fileSize.
+int write_partial(struct fs *fs, FileDescriptor *fileDesc, size_t blockIndex, size_t offset, size_t length,
+                  const char *src, size_t blockStart, size_t fileSize) {
+    if (write_behind_flush(fs, fileDesc, 1) == -1) {
+        return -1;
+    }
+
+    if (blockStart < fileSize) {
+        if (cache_read(fs->cache, blockIndex, fileDesc->bounce) == -1) {
+            return -1;
+        }
+    } else {
+        memset(fileDesc->bounce, 0, BLOCK_SIZE);
+    }
+
+    memcpy(fileDesc->bounce + offset, src, length);
+    fileDesc->wb_logical = blockStart / BLOCK_SIZE;
+    fileDesc->wb_block = blockIndex;
+    fileDesc->wb_dirty = 1;
+
+    if (offset + length == BLOCK_SIZE) {
+        return write_behind_flush(fs, fileDesc, 0);
+    }
+    return 0;
+}
+
+// Write @length bytes from @src, starting @offset bytes into the consecutive
+// blocks at @blockIndex, whose first block sits at file position @runStart.
+// Whole blocks are written straight from @src without being read first.
+int write_run(struct fs *fs, FileDescriptor *fileDesc, size_t blockIndex, size_t offset, size_t length,
+              const char *src, size_t runStart, size_t fileSize) {
+    // Partial head block
+    if (offset != 0 || length < BLOCK_SIZE) {
+        size_t bytes = min(BLOCK_SIZE - offset, length);
+        if (write_partial(fs, fileDesc, blockIndex, offset, bytes, src, runStart, fileSize) == -1) {
+            return -1;
+        }
+        src += bytes;
+        length -= bytes;
+        blockIndex++;
+        runStart += BLOCK_SIZE;
+    }
+
+    // Whole blocks
+    size_t wholeBlocks = length / BLOCK_SIZE;
+    if (wholeBlocks > 0) {
+        if (cache_write_range(fs->cache, blockIndex, wholeBlocks, src) == -1) {
+            return -1;
+        }
+        src += wholeBlocks * BLOCK_SIZE;
+        length -= wholeBlocks * BLOCK_SIZE;
+        blockIndex += wholeBlocks;
+        runStart += wholeBlocks * BLOCK_SIZE;
+    }
+
+    // Partial tail block
+    if (length > 0) {
+        return write_partial(fs, fileDesc, blockIndex, 0, length, src, runStart, fileSize);
+    }
+
+    return 0;
+}
+
+// Blocks a write of @count bytes may add, a partial one on each end and an
+// extent block included
+size_t write_blocks(size_t count) {
+    return count / BLOCK_SIZE + 3;
+}
+
+// Journal credits of a write of @count bytes: the FAT blocks of the blocks it
+// adds, then its extent block and the file's entry
+size_t write_credits(struct fs *fs, size_t count) {
+    return fat_credits(fs, write_blocks(count)) + 2;
+}
+
+// Bytes of a @count bytes write that go in at once: the byte count is returned
+// as a ssize_t, and the metadata the write changes must fit in a transaction
+size_t write_limit(struct fs *fs, size_t count) {
+    count = min(count, (size_t)SSIZE_MAX);
+
+    if (fs->journal && write_credits(fs, count) > journal_capacity(fs->journal)) {
+        count = (journal_capacity(fs->journal) - 6) * BLOCK_SIZE;
+    }
+    return count;
+}
+
+ssize_t fs_write_h(fs_t *fs, int fd, void *buf, size_t count) {
+    FileDescriptor *fileDesc = NULL;
+    size_t credits = 0;
+
+    // Writes too large for the journal are cut short
+    if (is_mounted(fs)) {
+        count = write_limit(fs, count);
+        credits = write_credits(fs, count);
+    }
+    if (!is_mounted(fs) || buf == NULL || (fileDesc = file_start(fs, fd, write_blocks(count), credits)) == NULL) {
+        fprintf(stderr, "Error: failed write intial state.\n");
+
+        return -1;
+    }
+
+    int index = fs->fd_table[fd]->index;
+    RootEntry *entry = &fs->RootEntryArray[index];
+    size_t bytesWritten = 0; 
+    size_t fileOffset = fs->fd_table[fd]->offset;
+    size_t remaining = count;
+
+    // Other descriptors of the file may buffer the blocks written here
+    if (write_behind_flush_file(fs, index, fileDesc) == -1) {
+        op_end(fs, credits);
+        file_unlock(fs, fileDesc);
+        return -1;
+    }
+
+    // Small write into the block the descriptor holds: only buffer it. Its
+    // size change reaches the cache with the block, or on fs_close().
+    size_t offsetInBlock = fileOffset % BLOCK_SIZE;
+    if (count > 0 && offsetInBlock + count <= BLOCK_SIZE && fileDesc->wb_block != FAT_EOC &&
+        fileDesc->wb_logical == fileOffset / BLOCK_SIZE) {
+        memcpy(fileDesc->bounce + offsetInBlock, buf, count);
+        fileDesc->wb_dirty = 1;
+        if (offsetInBlock + count == BLOCK_SIZE) {
+            write_behind_flush(fs, fileDesc, 0); // Kept dirty on failure, for a later attempt
+        }
+
+        fileDesc->offset += count;
+        if (fileDesc->offset > entry->file_size) {
+            pthread_rwlock_wrlock(&fs->fat_lock);
+            // The entry is only staged later, and keeps its credit until then
+            if (!entry_is_dirty(fs, index)) {
+                credits--;
+            }
+            entry->file_size = fileDesc->offset;
+            entry_dirty(fs, index);
+            pthread_rwlock_unlock(&fs->fat_lock);
         }
+        op_end(fs, credits);
+        file_unlock(fs, fileDesc);
+        return count;
+    }
+
+    // Whole blocks written below would otherwise be overwritten by the
+    // buffered one later on
+    if (write_behind_flush(fs, fileDesc, 1) == -1) {
+        op_end(fs, credits);
+        file_unlock(fs, fileDesc);
+        return -1;
+    }
 
+    while (remaining > 0) {
         size_t offsetInBlock = fileOffset % BLOCK_SIZE;
-        size_t spaceInBlock = BLOCK_SIZE - offsetInBlock;
-        size_t bytesInThisStep = min(spaceInBlock, remaining);
+        size_t blocksNeeded = (offsetInBlock + remaining + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        size_t maxRun = min(blocksNeeded, RUN_MAX_BLOCKS);
+        size_t logical = fileOffset / BLOCK_SIZE;
+        size_t runLength;
+        uint32_t lastBlock;
+
+        // Pick up the chain where the previous call left it. Mapping may
+        // grow the file, so it holds the allocator; the data copy does not.
+        pthread_rwlock_wrlock(&fs->fat_lock);
+        uint32_t currentBlock = map_run(fs, fs->fd_table[fd], logical, maxRun, &runLength, &lastBlock);
+        if (currentBlock == FAT_EOC) {
+            // Allocate as many contiguous blocks as the write needs
+            size_t allocated = file_extend(fs, fs->fd_table[fd], index, &lastBlock, blocksNeeded);
+            pthread_rwlock_unlock(&fs->fat_lock);
+            if (allocated == 0) {
+                break; // No more space available
+            }
+            continue;
+        }
+
+        // Grow the file up front when the run ends it, so that the run can
+        // cover new blocks too
+        if (runLength < maxRun && run_ends_file(fs, index, logical, runLength, currentBlock + runLength - 1)) {
+            lastBlock = currentBlock + runLength - 1;
+            if (file_extend(fs, fs->fd_table[fd], index, &lastBlock, blocksNeeded - runLength) > 0) {
+                currentBlock = map_run(fs, fs->fd_table[fd], logical, maxRun, &runLength, NULL);
+            }
+        }
+        pthread_rwlock_unlock(&fs->fat_lock);
+
+        size_t blockIndex = fs->super_block->data_block_index + currentBlock;
+        size_t spaceInRun = runLength * BLOCK_SIZE - offsetInBlock;
+        size_t bytesInThisStep = min(spaceInRun, remaining);
 
-        // Copy data to the block buffer and write it back
-        memcpy(blockBuffer + offsetInBlock, buf + bytesWritten, bytesInThisStep);
-        if (block_write(super_block->data_block_index + currentBlock, blockBuffer) == -1) {
+        if (write_run(fs, fs->fd_table[fd], blockIndex, offsetInBlock, bytesInThisStep, buf + bytesWritten,
+                      fileOffset - offsetInBlock, entry->file_size) == -1) {
             fprintf(stderr, "Error writing block\n");
 
             break; // Error writing block
         }
 
+        // Leave the cursor on the last block of the run
+        fs->fd_table[fd]->cursor_logical = fileOffset / BLOCK_SIZE + runLength - 1;
+        fs->fd_table[fd]->cursor_block = currentBlock + runLength - 1;
+
         bytesWritten += bytesInThisStep;
         remaining -= bytesInThisStep;
         fileOffset += bytesInThisStep;
-
-        if (bytesInThisStep == spaceInBlock) {
-            previousBlock = currentBlock;
-            currentBlock = fat_entries[currentBlock].entries[0]; // Move to the next block
-        }
     }
 
     // Update file descriptor and file size
-    fd_table[fd]->offset += bytesWritten;
-    if (fd_table[fd]->offset > RootEntryArray[fd_table[fd]->index].file_size) {
-        RootEntryArray[fd_table[fd]->index].file_size = fd_table[fd]->offset;
+    pthread_rwlock_wrlock(&fs->fat_lock);
+    fs->fd_table[fd]->offset += bytesWritten;
+    if (fs->fd_table[fd]->offset > entry->file_size) {
+        entry->file_size = fs->fd_table[fd]->offset;
+        entry_dirty(fs, index);
     }
 
+    // Persist the new chain links, size and first block, once each
+    flush_metadata(fs);
+    op_end(fs, credits);
+    pthread_rwlock_unlock(&fs->fat_lock);
+    file_unlock(fs, fileDesc);
+
     return bytesWritten; // Return the number of bytes actually written
-}
\ No newline at end of file
+}
+
+// Give the file open as @fileDesc at least @length bytes worth of blocks
+int file_reserve(struct fs *fs, FileDescriptor *fileDesc, size_t length) {
+    int index = fileDesc->index;
+
+    // Find the end of the file and how many blocks it already has
+    uint32_t lastBlock;
+    size_t haveBlocks = file_blocks(fs, index, &lastBlock);
+
+    size_t needBlocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (needBlocks <= haveBlocks) {
+        return 0;
+    }
+
+    size_t missing = needBlocks - haveBlocks;
+    if (missing > fs->free_block_count) {
+        fprintf(stderr, "Error: Not enough free blocks.\n");
+        return -1;
+    }
+
+    // Allocate the missing blocks in as few runs as possible, in a single FAT pass
+    while (missing > 0) {
+        size_t got = file_extend(fs, fileDesc, index, &lastBlock, missing);
+        if (got == 0) {
+            break;
+        }
+        missing -= got;
+    }
+
+    // All or nothing: give the blocks back if the disk could not supply them all
+    if (missing > 0) {
+        file_free(fs, index, haveBlocks);
+    }
+
+    if (flush_metadata(fs) == -1) {
+        return -1;
+    }
+
+    if (missing > 0) {
+        fprintf(stderr, "Error: Not enough free blocks.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int fs_fallocate_h(fs_t *fs, int fd, size_t length)
+{
+    if (!is_mounted(fs)) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;
+    }
+
+    // The FAT blocks of the blocks it adds, a partial one and an extent block
+    // included, then the extent block and the file's entry
+    size_t blocks = length / BLOCK_SIZE + 2;
+    size_t credits = fat_credits(fs, blocks) + 2;
+    FileDescriptor *fileDesc = file_start(fs, fd, blocks, credits);
+    if (!fileDesc) {
+        fprintf(stderr, "Error: Invalid file descriptor.\n");
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&fs->fat_lock);
+    int ret = file_reserve(fs, fileDesc, length);
+    op_end(fs, credits);
+    pthread_rwlock_unlock(&fs->fat_lock);
+
+    file_unlock(fs, fileDesc);
+    return ret;
+}
+
+// The calls without a handle work on default_fs
+
+int fs_mount(const char *diskname)
+{
+	return fs_mount_opts(diskname, NULL);
+}
+
+int fs_mount_opts(const char *diskname, const struct fs_mount_opts *opts)
+{
+	if (default_fs) {
+        fprintf(stderr, "Error: A filesystem is already mounted.\n");
+        return -1;
+	}
+
+	default_fs = fs_mount_opts_h(diskname, opts);
+	return default_fs ? 0 : -1;
+}
+
+int fs_umount(void)
+{
+	if (!default_fs) {
+        fprintf(stderr, "Error: Filesystem is not mounted.\n");
+        return -1;
+	}
+
+	int ret = fs_umount_h(default_fs);
+	default_fs = NULL;
+	return ret;
+}
+
+int fs_info(void)
+{
+	return fs_info_h(default_fs);
+}
+
+int fs_sync(void)
+{
+	return fs_sync_h(default_fs);
+}
+
+int fs_fsync(int fd)
+{
+	return fs_fsync_h(default_fs, fd);
+}
+
+int fs_create(const char *filename)
+{
+	return fs_create_h(default_fs, filename);
+}
+
+int fs_mkdir(const char *path)
+{
+	return fs_mkdir_h(default_fs, path);
+}
+
+int fs_delete(const char *filename)
+{
+	return fs_delete_h(default_fs, filename);
+}
+
+int fs_ls(void)
+{
+	return fs_ls_h(default_fs);
+}
+
+int fs_lsdir(const char *path)
+{
+	return fs_lsdir_h(default_fs, path);
+}
+
+int fs_open(const char *filename)
+{
+	return fs_open_h(default_fs, filename);
+}
+
+int fs_close(int fd)
+{
+	return fs_close_h(default_fs, fd);
+}
+
+ssize_t fs_stat(int fd)
+{
+	return fs_stat_h(default_fs, fd);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	return fs_lseek_h(default_fs, fd, offset);
+}
+
+int fs_fallocate(int fd, size_t length)
+{
+	return fs_fallocate_h(default_fs, fd, length);
+}
+
+ssize_t fs_write(int fd, void *buf, size_t count)
+{
+	return fs_write_h(default_fs, fd, buf, count);
+}
+
+ssize_t fs_read(int fd, void *buf, size_t count)
+{
+	return fs_read_h(default_fs, fd, buf, count);
+}
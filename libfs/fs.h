@@ -1,11 +1,8 @@
 #ifndef _FS_H
 #define _FS_H
 
-/**
- * WARNING: YOU ARE NOT ALLOWED TO MODIFY THIS FILE!
- */
-
 #include <stddef.h> /* for size_t definition */
+#include <sys/types.h> /* for ssize_t definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -16,24 +13,61 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** How the virtual disk file is accessed */
+enum fs_backend {
+	/** One pread()/pwrite() per transfer, behind the block cache */
+	FS_BACKEND_PREAD = 0,
+	/** Whole file memory-mapped; the kernel page cache does the caching */
+	FS_BACKEND_MMAP,
+};
+
+/** Options accepted by fs_mount_opts() */
+struct fs_mount_opts {
+	/** Number of blocks kept in the write-back block cache (0 disables it) */
+	size_t cache_blocks;
+	/** Disk access method; %FS_BACKEND_MMAP ignores @cache_blocks */
+	enum fs_backend backend;
+};
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
  *
  * Open the virtual disk file @diskname and mount the file system that it
  * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
+ * with fs_read() or written to it with fs_write(). The superblock version tells
+ * disks formatted by fs_make.x (16-bit FAT) from those formatted by fs_format.x
+ * (32-bit FAT, for disks and files beyond the 16-bit limits) and fs_format.x -e
+ * (files stored as extents).
+ *
+ * Once mounted, the file system may be used from several threads at once:
+ * reads and writes of different files run in parallel, and calls on a same
+ * file are serialized. fs_mount() and fs_umount() themselves must not run
+ * concurrently with any other call.
  *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_opts - Mount a file system with explicit options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults used by fs_mount()
+ *
+ * Same as fs_mount(), but lets the caller size the block cache that sits
+ * between the file system and the virtual disk, or memory-map the disk instead.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located, or if the cache cannot be allocated. 0 otherwise.
+ */
+int fs_mount_opts(const char *diskname, const struct fs_mount_opts *opts);
+
 /**
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
+ * disk file, after writing everything back as fs_sync() does.
  *
  * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
  * closed, or if there are still open file descriptors. 0 otherwise.
@@ -49,18 +83,55 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * fs_sync - Flush cached blocks to disk
+ *
+ * Write every dirty block held by the block cache back to the virtual disk and
+ * flush the disk file (fdatasync(), or msync() when memory-mapped). File data
+ * goes first, then the FAT and extent blocks, then the directories, with a
+ * flush of the disk file between each, so that a crash never leaves on disk
+ * metadata referring to data that was not written. fs_umount() does this
+ * implicitly.
+ *
+ * On disks made with a journal by fs_format.x, the FAT, extent and directory
+ * blocks changed since the last call are instead appended to the journal as a
+ * single transaction, and written in place later. fs_mount() replays the
+ * journal, so the metadata is always found as it was at the end of one of these
+ * calls, or of a transaction committed early because the journal filled up.
+ *
+ * Return: -1 if no FS is currently mounted, or if a block cannot be written.
+ * 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_fsync - Flush a file to disk
+ * @fd: File descriptor
+ *
+ * Make the data and size of the file referenced by file descriptor @fd
+ * durable. The FAT and directory blocks are shared with the other files, so
+ * this is done as by fs_sync(), for the whole file system.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if a block cannot be
+ * written. 0 otherwise.
+ */
+int fs_fsync(int fd);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
  *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * Create a new and empty file named @filename in the mounted file system.
+ * @filename is a NULL-terminated path: names of existing directories followed
+ * by the file name, separated by '/', with an optional leading '/'. Each
+ * component cannot exceed %FS_FILENAME_LEN characters (including the NULL
+ * character). A name without '/' refers to the root directory.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
- * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * file named @filename already exists, or if a component of @filename is too
+ * long or names no directory, or if the root directory already contains
+ * %FS_FILE_MAX_COUNT files, or if a subdirectory cannot grow. 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -68,8 +139,8 @@ int fs_create(const char *filename);
  * fs_delete - Delete a file
  * @filename: File name
  *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * Delete the file or empty directory at path @filename (see fs_create()) from
+ * the mounted file system.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * Return: -1 if @filename is invalid, if there is no file named @filename to
@@ -77,6 +148,20 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_mkdir - Create a new directory
+ * @path: Directory path
+ *
+ * Create a new and empty directory at @path, named like files (see
+ * fs_create()). The root directory keeps its fixed %FS_FILE_MAX_COUNT entries,
+ * while subdirectories grow as needed, and can be nested.
+ *
+ * Return: -1 if no FS is currently mounted, or if @path is invalid, or if an
+ * entry named @path already exists, or if the root directory is full. 0
+ * otherwise.
+ */
+int fs_mkdir(const char *path);
+
 /**
  * fs_ls - List files on file system
  *
@@ -86,17 +171,29 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_lsdir - List files of a directory
+ * @path: Directory path
+ *
+ * List information about the entries of directory @path, in no particular
+ * order. An empty path or "/" lists the root directory, like fs_ls().
+ *
+ * Return: -1 if no FS is currently mounted, or if @path names no directory. 0
+ * otherwise.
+ */
+int fs_lsdir(const char *path);
+
 /**
  * fs_open - Open a file
  * @filename: File name
  *
- * Open file named @filename for reading and writing, and return the
- * corresponding file descriptor. The file descriptor is a non-negative integer
- * that is used subsequently to access the contents of the file. The file offset
- * of the file descriptor is set to 0 initially (beginning of the file). If the
- * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * Open file at path @filename (see fs_create()) for reading and writing, and
+ * return the corresponding file descriptor. The file descriptor is a
+ * non-negative integer that is used subsequently to access the contents of the
+ * file. The file offset of the file descriptor is set to 0 initially (beginning
+ * of the file). If the same file is opened multiple files, fs_open() must
+ * return distinct file descriptors. A maximum of %FS_OPEN_MAX_COUNT files can
+ * be open simultaneously. Directories cannot be opened.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * there is no file named @filename to open, or if there are already
@@ -109,10 +206,12 @@ int fs_open(const char *filename);
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd, after passing the writes it still buffers to the
+ * block cache.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open). 0 otherwise.
+ * invalid (out of bounds or not currently open), or if its buffered writes
+ * cannot be written back (@fd is closed anyway). 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -126,7 +225,7 @@ int fs_close(int fd);
  * invalid (out of bounds or not currently open). Otherwise return the current
  * size of file.
  */
-int fs_stat(int fd);
+ssize_t fs_stat(int fd);
 
 /**
  * fs_lseek - Set file offset
@@ -143,6 +242,23 @@ int fs_stat(int fd);
  */
 int fs_lseek(int fd, size_t offset);
 
+/**
+ * fs_fallocate - Reserve space for a file
+ * @fd: File descriptor
+ * @length: Number of bytes the file should be able to hold
+ *
+ * Make sure the file referenced by file descriptor @fd owns enough data blocks
+ * to hold @length bytes, allocating the missing ones in as few contiguous runs
+ * as possible and writing each modified FAT block once. The file size is not
+ * changed: the reserved blocks are filled by subsequent fs_write() calls, which
+ * then cannot run out of space before the file reaches @length bytes.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the disk does not have
+ * enough free blocks (nothing is allocated in that case). 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t length);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -158,12 +274,19 @@ int fs_lseek(int fd, size_t offset);
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
+ * At most %SSIZE_MAX bytes are written by one call.
+ *
+ * Writes that end inside a block leave it buffered in the file descriptor, and
+ * later writes within that block are only copied there. The block is passed to
+ * the block cache once it is full, when the file is read or written past it,
+ * and by fs_close(), fs_sync() and fs_umount().
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * writes buffered for the file cannot be written back. Otherwise
  * return the number of bytes actually written.
  */
-int fs_write(int fd, void *buf, size_t count);
+ssize_t fs_write(int fd, void *buf, size_t count);
 
 /**
  * fs_read - Read from a file
@@ -177,13 +300,106 @@ int fs_write(int fd, void *buf, size_t count);
  *
  * The number of bytes read can be smaller than @count if there are less than
  * @count bytes until the end of the file (it can even be 0 if the file offset
- * is at the end of the file). The file offset of the file descriptor is
- * implicitly incremented by the number of bytes that were actually read.
+ * is at the end of the file), and is at most %SSIZE_MAX. The file offset of the
+ * file descriptor is implicitly incremented by the number of bytes that were
+ * actually read.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually read.
  */
-int fs_read(int fd, void *buf, size_t count);
+ssize_t fs_read(int fd, void *buf, size_t count);
+
+/*
+ * Handle-based interface: a process can mount any number of disks at once,
+ * each as its own instance, with its own block cache, open files and locks.
+ * Every function below takes the instance as first argument, as returned by
+ * fs_mount_h(), and otherwise behaves like its counterpart without the _h
+ * suffix. Those work on a default instance, the one mounted by fs_mount().
+ * File descriptors belong to the instance they were opened on.
+ */
+
+/** Mounted file system, see fs_mount_h() */
+typedef struct fs fs_t;
+
+/**
+ * fs_mount_h - Mount a file system as a new instance
+ * @diskname: Name of the virtual disk file
+ *
+ * Same as fs_mount(), but the file system is not made the default one, and
+ * this succeeds whatever else is mounted. A disk file should not be mounted
+ * twice at the same time.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. Otherwise the instance, to be released with
+ * fs_umount_h().
+ */
+fs_t *fs_mount_h(const char *diskname);
+
+/**
+ * fs_mount_opts_h - Mount a file system as a new instance, with options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults
+ *
+ * Same as fs_mount_h(), with the options of fs_mount_opts().
+ *
+ * Return: Same as fs_mount_h().
+ */
+fs_t *fs_mount_opts_h(const char *diskname, const struct fs_mount_opts *opts);
+
+/**
+ * fs_umount_h - Unmount a file system instance
+ * @fs: Instance returned by fs_mount_h()
+ *
+ * Same as fs_umount(). @fs is freed, even if an error is reported.
+ *
+ * Return: Same as fs_umount().
+ */
+int fs_umount_h(fs_t *fs);
+
+/** fs_info_h - fs_info() on instance @fs */
+int fs_info_h(fs_t *fs);
+
+/** fs_sync_h - fs_sync() on instance @fs */
+int fs_sync_h(fs_t *fs);
+
+/** fs_fsync_h - fs_fsync() on instance @fs */
+int fs_fsync_h(fs_t *fs, int fd);
+
+/** fs_create_h - fs_create() on instance @fs */
+int fs_create_h(fs_t *fs, const char *filename);
+
+/** fs_delete_h - fs_delete() on instance @fs */
+int fs_delete_h(fs_t *fs, const char *filename);
+
+/** fs_mkdir_h - fs_mkdir() on instance @fs */
+int fs_mkdir_h(fs_t *fs, const char *path);
+
+/** fs_ls_h - fs_ls() on instance @fs */
+int fs_ls_h(fs_t *fs);
+
+/** fs_lsdir_h - fs_lsdir() on instance @fs */
+int fs_lsdir_h(fs_t *fs, const char *path);
+
+/** fs_open_h - fs_open() on instance @fs */
+int fs_open_h(fs_t *fs, const char *filename);
+
+/** fs_close_h - fs_close() on instance @fs */
+int fs_close_h(fs_t *fs, int fd);
+
+/** fs_stat_h - fs_stat() on instance @fs */
+ssize_t fs_stat_h(fs_t *fs, int fd);
+
+/** fs_lseek_h - fs_lseek() on instance @fs */
+int fs_lseek_h(fs_t *fs, int fd, size_t offset);
+
+/** fs_fallocate_h - fs_fallocate() on instance @fs */
+int fs_fallocate_h(fs_t *fs, int fd, size_t length);
+
+/** fs_write_h - fs_write() on instance @fs */
+ssize_t fs_write_h(fs_t *fs, int fd, void *buf, size_t count);
+
+/** fs_read_h - fs_read() on instance @fs */
+ssize_t fs_read_h(fs_t *fs, int fd, void *buf, size_t count);
 
 #endif /* _FS_H */
@@ -0,0 +1,613 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "cache.h"
+#include "disk.h"
+#include "journal.h"
+
+#define journal_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define HEADER_MAGIC "ECSJRNL"
+#define DESCRIPTOR_MAGIC "ECSJDSC"
+#define COMMIT_MAGIC "ECSJCMT"
+#define MAGIC_LENGTH 8
+
+/* Block numbers a descriptor block has room for */
+#define JOURNAL_TAGS ((BLOCK_SIZE - 24) / sizeof(uint32_t))
+
+/* Empty hash table entry, and forgotten staged block */
+#define NO_BLOCK SIZE_MAX
+
+/* First block of the region, written by the formatter */
+struct __attribute__((packed)) journal_header {
+	char magic[MAGIC_LENGTH];
+	/* Sequence number of the transaction at the start of the log */
+	uint64_t sequence;
+	uint8_t padding[BLOCK_SIZE - 16];
+};
+
+/* First block of a transaction, followed by a copy of each of @count blocks */
+struct __attribute__((packed)) journal_descriptor {
+	char magic[MAGIC_LENGTH];
+	uint64_t sequence;
+	uint32_t count;
+	uint32_t revokes;
+	/* @count home blocks, then @revokes blocks not to replay any more */
+	uint32_t tags[JOURNAL_TAGS];
+};
+
+/* Last block of a transaction, which is only replayed if the checksum holds */
+struct __attribute__((packed)) journal_commit {
+	char magic[MAGIC_LENGTH];
+	uint64_t sequence;
+	/* FNV-1a of the descriptor and the block copies */
+	uint64_t checksum;
+	uint8_t padding[BLOCK_SIZE - 24];
+};
+
+/* What the journal knows about a home block */
+struct journal_entry {
+	/* Home block, NO_BLOCK for a free entry */
+	size_t block;
+	/* Slot in the running transaction, or -1 */
+	int staged;
+	/* In the log since the last checkpoint */
+	int logged;
+	/* Revoked by the running transaction */
+	int revoked;
+};
+
+/* Journal instance description */
+struct journal {
+	struct cache *cache;
+	struct disk *disk;
+	/* Journal region */
+	size_t start;
+	size_t count;
+	/* Sequence number of the running transaction */
+	uint64_t sequence;
+	/* Next free block of the log, from 1 */
+	size_t head;
+	/* Staged blocks and revokes a transaction can hold */
+	size_t capacity;
+	/* Credits taken by journal_reserve() and not released yet */
+	size_t reserved;
+	/* Running transaction: home block of each slot, or NO_BLOCK */
+	size_t nstaged;
+	size_t *staged;
+	enum cache_kind *kinds;
+	uint8_t *data;
+	size_t nrevoked;
+	/* Home blocks staged or logged (linear probing), power of two sized */
+	struct journal_entry *entries;
+	size_t nentries;
+	/* journal_forget() could not revoke a block */
+	int failed;
+	pthread_mutex_t lock;
+};
+
+static uint64_t checksum(uint64_t hash, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+#define CHECKSUM_INIT 0xcbf29ce484222325ULL
+
+/* Entry of @block, a free entry to fill in if it has none */
+static struct journal_entry *entry_of(struct journal *j, size_t block)
+{
+	size_t mask = j->nentries - 1;
+	size_t i = (block * 0x9e3779b97f4a7c15ULL) & mask;
+
+	while (j->entries[i].block != NO_BLOCK && j->entries[i].block != block)
+		i = (i + 1) & mask;
+
+	return &j->entries[i];
+}
+
+/* Keep only the entries still meaningful, dropping @logged ones with @clear */
+static void entries_rebuild(struct journal *j, int clear)
+{
+	size_t n = j->nentries;
+	struct journal_entry *old = malloc(n * sizeof(*old));
+
+	/* Entries are dropped in place when the copy cannot be made */
+	if (!old) {
+		for (size_t i = 0; clear && i < n; i++)
+			j->entries[i].logged = j->entries[i].revoked = 0;
+		return;
+	}
+
+	memcpy(old, j->entries, n * sizeof(*old));
+	for (size_t i = 0; i < n; i++)
+		j->entries[i].block = NO_BLOCK;
+
+	for (size_t i = 0; i < n; i++) {
+		struct journal_entry *e;
+
+		if (old[i].block == NO_BLOCK)
+			continue;
+		if (clear)
+			old[i].logged = old[i].revoked = 0;
+		if (old[i].staged < 0 && !old[i].logged && !old[i].revoked)
+			continue;
+		e = entry_of(j, old[i].block);
+		*e = old[i];
+	}
+	free(old);
+}
+
+static int header_write(struct journal *j)
+{
+	struct journal_header header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, HEADER_MAGIC, MAGIC_LENGTH);
+	header.sequence = j->sequence;
+
+	return block_write_h(j->disk, j->start, &header);
+}
+
+/*
+ * Read the transaction at log block @pos into @desc and @data, which has room
+ * for JOURNAL_TAGS blocks. Return: 0 if it is complete and numbered
+ * @sequence, -1 otherwise.
+ */
+static int transaction_read(struct journal *j, size_t pos, uint64_t sequence,
+			    struct journal_descriptor *desc, uint8_t *data)
+{
+	struct journal_commit commit;
+	uint64_t hash;
+
+	if (pos + 2 > j->count || block_read_h(j->disk, j->start + pos, desc))
+		return -1;
+	if (memcmp(desc->magic, DESCRIPTOR_MAGIC, MAGIC_LENGTH) ||
+	    desc->sequence != sequence ||
+	    (size_t)desc->count + desc->revokes > JOURNAL_TAGS ||
+	    pos + desc->count + 2 > j->count)
+		return -1;
+
+	for (uint32_t i = 0; i < desc->count; i++) {
+		if (block_read_h(j->disk, j->start + pos + 1 + i,
+				 data + (size_t)i * BLOCK_SIZE))
+			return -1;
+	}
+	if (block_read_h(j->disk, j->start + pos + 1 + desc->count, &commit))
+		return -1;
+
+	hash = checksum(CHECKSUM_INIT, desc, BLOCK_SIZE);
+	hash = checksum(hash, data, (size_t)desc->count * BLOCK_SIZE);
+	if (memcmp(commit.magic, COMMIT_MAGIC, MAGIC_LENGTH) ||
+	    commit.sequence != sequence || commit.checksum != hash)
+		return -1;
+
+	return 0;
+}
+
+/* A block revoked by transaction @sequence */
+struct revoke {
+	size_t block;
+	uint64_t sequence;
+};
+
+/*
+ * Write the complete transactions of the log home. The first pass finds where
+ * the log ends and collects the revokes, the second applies each block copy
+ * unless a transaction at least as recent revoked the block.
+ */
+static int replay(struct journal *j)
+{
+	struct journal_descriptor *desc = malloc(sizeof(*desc));
+	uint8_t *data = malloc(JOURNAL_TAGS * BLOCK_SIZE);
+	struct revoke *revokes = NULL;
+	size_t nrevokes = 0, pos = 1, ntrans = 0;
+	uint64_t sequence = j->sequence;
+	int ret = 0;
+
+	if (!desc || !data) {
+		free(desc);
+		free(data);
+		return -1;
+	}
+
+	while (!transaction_read(j, pos, sequence, desc, data)) {
+		struct revoke *grown = realloc(revokes, (nrevokes + desc->revokes) *
+						       sizeof(*revokes));
+
+		if (!grown && desc->revokes) {
+			ret = -1;
+			goto out;
+		}
+		revokes = grown;
+		for (uint32_t i = 0; i < desc->revokes; i++) {
+			revokes[nrevokes].block = desc->tags[desc->count + i];
+			revokes[nrevokes++].sequence = sequence;
+		}
+		pos += desc->count + 2;
+		sequence++;
+		ntrans++;
+	}
+
+	pos = 1;
+	for (size_t t = 0; t < ntrans; t++) {
+		if (transaction_read(j, pos, j->sequence, desc, data)) {
+			ret = -1;
+			goto out;
+		}
+		for (uint32_t i = 0; i < desc->count; i++) {
+			size_t r;
+
+			for (r = 0; r < nrevokes; r++) {
+				if (revokes[r].block == desc->tags[i] &&
+				    revokes[r].sequence >= j->sequence)
+					break;
+			}
+			if (r < nrevokes)
+				continue;
+			if (cache_write_kind(j->cache, desc->tags[i],
+					     data + (size_t)i * BLOCK_SIZE,
+					     CACHE_ALLOC)) {
+				ret = -1;
+				goto out;
+			}
+		}
+		pos += desc->count + 2;
+		j->sequence++;
+	}
+
+	/* Home blocks are on disk before the log is emptied */
+	if (ntrans && (cache_sync(j->cache) || block_disk_sync_h(j->disk) ||
+		       header_write(j) || block_disk_sync_h(j->disk)))
+		ret = -1;
+
+out:
+	free(revokes);
+	free(desc);
+	free(data);
+	return ret;
+}
+
+struct journal *journal_open(struct cache *cache, struct disk *disk,
+			     size_t start, size_t count)
+{
+	struct journal_header header;
+	struct journal *j;
+	size_t n;
+
+	if (count < JOURNAL_MIN_BLOCKS) {
+		journal_error("journal of %zu blocks too small", count);
+		return NULL;
+	}
+
+	if (block_read_h(disk, start, &header) ||
+	    memcmp(header.magic, HEADER_MAGIC, MAGIC_LENGTH)) {
+		journal_error("invalid journal header");
+		return NULL;
+	}
+
+	j = calloc(1, sizeof(*j));
+	if (!j)
+		return NULL;
+	j->cache = cache;
+	j->disk = disk;
+	j->start = start;
+	j->count = count;
+	j->sequence = header.sequence;
+	j->head = 1;
+	j->capacity = count - 3 < JOURNAL_TAGS ? count - 3 : JOURNAL_TAGS;
+	pthread_mutex_init(&j->lock, NULL);
+
+	/* Logged and staged blocks together keep the table at most half full */
+	for (n = 1; n < 2 * (count + j->capacity); n <<= 1)
+		;
+	j->nentries = n;
+	j->entries = malloc(n * sizeof(*j->entries));
+	j->staged = malloc(j->capacity * sizeof(*j->staged));
+	j->kinds = malloc(j->capacity * sizeof(*j->kinds));
+	j->data = malloc(j->capacity * BLOCK_SIZE);
+	if (!j->entries || !j->staged || !j->kinds || !j->data)
+		goto fail;
+	for (size_t i = 0; i < n; i++)
+		j->entries[i].block = NO_BLOCK;
+
+	if (replay(j)) {
+		journal_error("unable to replay the journal");
+		goto fail;
+	}
+
+	return j;
+
+fail:
+	pthread_mutex_destroy(&j->lock);
+	free(j->entries);
+	free(j->staged);
+	free(j->kinds);
+	free(j->data);
+	free(j);
+	return NULL;
+}
+
+static int checkpoint_locked(struct journal *j)
+{
+	if (j->head == 1)
+		return 0;
+
+	/* Committed blocks are all in the cache, or were evicted to disk */
+	if (cache_sync_kind(j->cache, CACHE_ALLOC) == -1 ||
+	    cache_sync_kind(j->cache, CACHE_DIR) == -1 ||
+	    block_disk_sync_h(j->disk) || header_write(j) ||
+	    block_disk_sync_h(j->disk)) {
+		journal_error("unable to checkpoint the journal");
+		return -1;
+	}
+
+	j->head = 1;
+	entries_rebuild(j, 1);
+	j->nrevoked = 0;
+	return 0;
+}
+
+static int commit_locked(struct journal *j)
+{
+	struct journal_descriptor desc;
+	struct journal_commit commit;
+	struct iovec iov[JOURNAL_TAGS + 2];
+	size_t n = 0, r = 0;
+	int iovcnt = 1, ret = 0;
+
+	/* Ordered mode: data first */
+	if (cache_sync_kind(j->cache, CACHE_DATA) == -1 ||
+	    block_disk_sync_h(j->disk)) {
+		journal_error("unable to write back data blocks");
+		return -1;
+	}
+
+	for (size_t i = 0; i < j->nstaged; i++)
+		n += j->staged[i] != NO_BLOCK;
+	if (!n && !j->nrevoked) {
+		j->nstaged = 0;
+		j->reserved = 0;
+		return 0;
+	}
+
+	if (j->head + n + 2 > j->count && checkpoint_locked(j))
+		return -1;
+
+	memset(&desc, 0, sizeof(desc));
+	memcpy(desc.magic, DESCRIPTOR_MAGIC, MAGIC_LENGTH);
+	desc.sequence = j->sequence;
+	desc.count = n;
+	iov[0].iov_base = &desc;
+	iov[0].iov_len = BLOCK_SIZE;
+	for (size_t i = 0; i < j->nstaged; i++) {
+		if (j->staged[i] == NO_BLOCK)
+			continue;
+		desc.tags[iovcnt - 1] = j->staged[i];
+		iov[iovcnt].iov_base = j->data + i * BLOCK_SIZE;
+		iov[iovcnt++].iov_len = BLOCK_SIZE;
+	}
+	for (size_t i = 0; j->nrevoked && i < j->nentries; i++) {
+		if (j->entries[i].block != NO_BLOCK && j->entries[i].revoked)
+			desc.tags[n + r++] = j->entries[i].block;
+	}
+	desc.revokes = r;
+
+	memset(&commit, 0, sizeof(commit));
+	memcpy(commit.magic, COMMIT_MAGIC, MAGIC_LENGTH);
+	commit.sequence = j->sequence;
+	commit.checksum = checksum(CHECKSUM_INIT, &desc, BLOCK_SIZE);
+	for (int i = 1; i < iovcnt; i++)
+		commit.checksum = checksum(commit.checksum, iov[i].iov_base,
+					   BLOCK_SIZE);
+	iov[iovcnt].iov_base = &commit;
+	iov[iovcnt++].iov_len = BLOCK_SIZE;
+
+	if (block_writev_h(j->disk, j->start + j->head, iov, iovcnt) ||
+	    block_disk_sync_h(j->disk)) {
+		journal_error("unable to append to the journal");
+		return -1;
+	}
+
+	/* Logged, the blocks may now reach their home location */
+	for (size_t i = 0; i < j->nstaged; i++) {
+		struct journal_entry *e;
+
+		if (j->staged[i] == NO_BLOCK)
+			continue;
+		e = entry_of(j, j->staged[i]);
+		e->staged = -1;
+		e->logged = 1;
+		if (cache_write_kind(j->cache, j->staged[i],
+				     j->data + i * BLOCK_SIZE, j->kinds[i]))
+			ret = -1;
+	}
+	/* A committed revoke covers every copy logged so far */
+	for (size_t i = 0; j->nrevoked && i < j->nentries; i++) {
+		if (j->entries[i].revoked)
+			j->entries[i].revoked = j->entries[i].logged = 0;
+	}
+
+	j->head += n + 2;
+	j->sequence++;
+	j->nstaged = 0;
+	j->nrevoked = 0;
+	j->reserved = 0;
+	entries_rebuild(j, 0);
+	return ret;
+}
+
+int journal_close(struct journal *j)
+{
+	int ret;
+
+	if (!j)
+		return -1;
+
+	pthread_mutex_lock(&j->lock);
+	ret = commit_locked(j);
+	if (checkpoint_locked(j) || j->failed)
+		ret = -1;
+	pthread_mutex_unlock(&j->lock);
+
+	pthread_mutex_destroy(&j->lock);
+	free(j->entries);
+	free(j->staged);
+	free(j->kinds);
+	free(j->data);
+	free(j);
+
+	return ret;
+}
+
+int journal_write(struct journal *j, size_t block, const void *buf,
+		  enum cache_kind kind)
+{
+	struct journal_entry *e;
+
+	pthread_mutex_lock(&j->lock);
+	e = entry_of(j, block);
+	if (e->block == NO_BLOCK || e->staged < 0) {
+		if (j->nstaged + j->nrevoked >= j->capacity) {
+			pthread_mutex_unlock(&j->lock);
+			journal_error("transaction full");
+			return -1;
+		}
+		if (e->block == NO_BLOCK)
+			*e = (struct journal_entry){ .block = block };
+		e->staged = j->nstaged++;
+		j->staged[e->staged] = block;
+	}
+
+	/* A new copy supersedes the revoke, and is replayed after older ones */
+	if (e->revoked) {
+		e->revoked = 0;
+		j->nrevoked--;
+	}
+	memcpy(j->data + (size_t)e->staged * BLOCK_SIZE, buf, BLOCK_SIZE);
+	j->kinds[e->staged] = kind;
+	pthread_mutex_unlock(&j->lock);
+
+	return 0;
+}
+
+int journal_read(struct journal *j, size_t block, void *buf)
+{
+	struct journal_entry *e;
+	int found;
+
+	pthread_mutex_lock(&j->lock);
+	e = entry_of(j, block);
+	found = e->block != NO_BLOCK && e->staged >= 0;
+	if (found)
+		memcpy(buf, j->data + (size_t)e->staged * BLOCK_SIZE, BLOCK_SIZE);
+	pthread_mutex_unlock(&j->lock);
+
+	return found;
+}
+
+void journal_forget(struct journal *j, size_t block)
+{
+	struct journal_entry *e;
+
+	pthread_mutex_lock(&j->lock);
+	e = entry_of(j, block);
+	if (e->block == NO_BLOCK) {
+		pthread_mutex_unlock(&j->lock);
+		return;
+	}
+
+	if (e->staged >= 0) {
+		j->staged[e->staged] = NO_BLOCK;
+		e->staged = -1;
+	}
+	if (e->logged && !e->revoked) {
+		if (j->nstaged + j->nrevoked >= j->capacity) {
+			journal_error("transaction full");
+			j->failed = 1;
+		} else {
+			e->revoked = 1;
+			j->nrevoked++;
+		}
+	}
+	pthread_mutex_unlock(&j->lock);
+}
+
+int journal_logged(struct journal *j, size_t block)
+{
+	struct journal_entry *e;
+	int logged;
+
+	pthread_mutex_lock(&j->lock);
+	e = entry_of(j, block);
+	logged = e->block != NO_BLOCK && e->logged && !e->revoked;
+	pthread_mutex_unlock(&j->lock);
+
+	return logged;
+}
+
+size_t journal_capacity(struct journal *j)
+{
+	return j->capacity;
+}
+
+int journal_reserve(struct journal *j, size_t credits)
+{
+	int ret = 0;
+
+	if (credits > j->capacity)
+		return -1;
+
+	pthread_mutex_lock(&j->lock);
+	if (j->nstaged + j->nrevoked + j->reserved + credits > j->capacity)
+		ret = 1;
+	else
+		j->reserved += credits;
+	pthread_mutex_unlock(&j->lock);
+
+	return ret;
+}
+
+void journal_release(struct journal *j, size_t credits)
+{
+	pthread_mutex_lock(&j->lock);
+	j->reserved -= credits < j->reserved ? credits : j->reserved;
+	pthread_mutex_unlock(&j->lock);
+}
+
+int journal_commit(struct journal *j)
+{
+	int ret;
+
+	pthread_mutex_lock(&j->lock);
+	ret = commit_locked(j);
+	if (j->failed) {
+		j->failed = 0;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	return ret;
+}
+
+int journal_checkpoint(struct journal *j)
+{
+	int ret;
+
+	pthread_mutex_lock(&j->lock);
+	ret = checkpoint_locked(j);
+	pthread_mutex_unlock(&j->lock);
+
+	return ret;
+}
@@ -0,0 +1,158 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stddef.h> /* for size_t definition */
+
+#include "cache.h"
+#include "disk.h"
+
+/**
+ * Smallest journal: a header, and a transaction with room for the blocks a
+ * single file system operation may change, see journal_reserve()
+ */
+#define JOURNAL_MIN_BLOCKS 32
+
+/** Metadata journal, see journal_open() */
+struct journal;
+
+/**
+ * journal_open - Open the metadata journal of a disk and replay it
+ * @cache: Cache the journaled blocks are read from and checkpointed through
+ * @disk: Disk of @cache, the log is read and written directly
+ * @start: Index of the first block of the journal region
+ * @count: Number of blocks in the journal region, at least %JOURNAL_MIN_BLOCKS
+ *
+ * The first block of the region is a header naming the first transaction to
+ * replay, the others hold a log of transactions: a descriptor block listing
+ * the blocks that follow, a copy of each, then a commit block carrying a
+ * checksum of the whole. Every complete transaction left in the log by a
+ * crash is written back to its home blocks, except for blocks revoked by a
+ * later transaction, and the log is emptied.
+ *
+ * Return: NULL if the header is invalid, if the log cannot be replayed, or if
+ * memory cannot be allocated. Otherwise the journal, passed as @j to the other
+ * functions.
+ */
+struct journal *journal_open(struct cache *cache, struct disk *disk,
+			     size_t start, size_t count);
+
+/**
+ * journal_close - Commit, checkpoint and release a metadata journal
+ * @j: Journal to release
+ *
+ * Staged blocks are committed, then every committed block is written to its
+ * home location and the log is emptied, so that the disk can be used without
+ * replaying it. The cache stays open.
+ *
+ * Return: -1 if @j is NULL, or if blocks cannot be committed or written back.
+ * 0 otherwise.
+ */
+int journal_close(struct journal *j);
+
+/**
+ * journal_write - Stage a metadata block in the running transaction
+ * @j: Journal to go through
+ * @block: Index of the home block
+ * @buf: New content of the block, %BLOCK_SIZE bytes
+ * @kind: What the block holds, passed to cache_write_kind() once committed
+ *
+ * The block is kept in memory until journal_commit(), and only then handed to
+ * the cache, so that it never reaches its home location before the log holds
+ * it. The running transaction must have room for it, see journal_reserve().
+ *
+ * Return: -1 if the transaction is full. 0 otherwise.
+ */
+int journal_write(struct journal *j, size_t block, const void *buf,
+		  enum cache_kind kind);
+
+/**
+ * journal_read - Read a staged metadata block
+ * @j: Journal to look into
+ * @block: Index of the home block
+ * @buf: Data buffer to be filled with the staged content
+ *
+ * Return: 1 if @block is staged in the running transaction and was copied to
+ * @buf. 0 otherwise, the cache then holds the latest content.
+ */
+int journal_read(struct journal *j, size_t block, void *buf);
+
+/**
+ * journal_forget - Tell the journal that a block was freed
+ * @j: Journal to update
+ * @block: Index of the home block
+ *
+ * Drop the staged copy of @block. If @block was logged since the last
+ * checkpoint, the running transaction revokes it, so that a replay does not
+ * write the old metadata over whatever the block holds next. A revoke takes
+ * room in the transaction like a block does; when there is none left, the
+ * next journal_commit() fails.
+ */
+void journal_forget(struct journal *j, size_t block);
+
+/**
+ * journal_logged - Tell whether freeing a block takes a revoke
+ * @j: Journal to look into
+ * @block: Index of the home block
+ *
+ * Return: 1 if journal_forget() would revoke @block, that is if it was logged
+ * since the last checkpoint and is not revoked yet. 0 otherwise.
+ */
+int journal_logged(struct journal *j, size_t block);
+
+/**
+ * journal_capacity - Size of a transaction
+ * @j: Journal to look into
+ *
+ * Return: the number of blocks and revokes a transaction holds, which is the
+ * most credits a single journal_reserve() can take.
+ */
+size_t journal_capacity(struct journal *j);
+
+/**
+ * journal_reserve - Make sure an operation fits in the running transaction
+ * @j: Journal to reserve in
+ * @credits: Most blocks and revokes the operation stages
+ *
+ * Transactions are only committed between operations, so that a replay
+ * never applies half of one. An operation thus takes credits for everything
+ * it may stage before it changes anything, and gives back those it does not
+ * need any more with journal_release(). Credits still taken when the
+ * transaction commits are dropped with it.
+ *
+ * Return: -1 if @credits is more than journal_capacity(). 1 if the running
+ * transaction has no room left for them, it must then be committed before
+ * the operation starts over. 0 otherwise.
+ */
+int journal_reserve(struct journal *j, size_t credits);
+
+/**
+ * journal_release - Give back credits taken by journal_reserve()
+ * @j: Journal to release in
+ * @credits: Credits the operation no longer needs, its staged blocks being
+ * accounted for by the transaction itself
+ */
+void journal_release(struct journal *j, size_t credits);
+
+/**
+ * journal_commit - Make the running transaction durable
+ * @j: Journal to commit
+ *
+ * Write back the dirty data blocks of the cache and flush the disk file, so
+ * that the metadata never refers to data that is not on disk. Then append the
+ * staged blocks to the log with a single vectored write, flush the disk file
+ * again, and hand the blocks to the cache, which writes them home later. The
+ * log is checkpointed first when it has no room left for the transaction.
+ *
+ * Return: -1 if a block cannot be written. 0 otherwise.
+ */
+int journal_commit(struct journal *j);
+
+/**
+ * journal_checkpoint - Write committed blocks home and empty the log
+ * @j: Journal to checkpoint
+ *
+ * Return: -1 if a block cannot be written. 0 otherwise.
+ */
+int journal_checkpoint(struct journal *j);
+
+#endif /* _JOURNAL_H */